@@ -8,21 +8,73 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KILO_X86 1
+#endif
+
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_MESSAGE_SECONDS 5  // how long a status message stays up
+// matches are counted again once the text has gone this long without an edit
+#ifndef KILO_RECOUNT_MS
+#define KILO_RECOUNT_MS 300
+#endif
+// files with at least this many rows have their comment states resolved on
+// all cores when opened
+#ifndef KILO_HL_PARALLEL_ROWS
+#define KILO_HL_PARALLEL_ROWS 65536
+#endif
+// files at least this large get a trigram index for searching, built in the
+// background; it keeps one entry per trigram for each group of
+// 1 << KILO_INDEX_GROUP_SHIFT lines
+#ifndef KILO_INDEX_MIN_BYTES
+#define KILO_INDEX_MIN_BYTES (64 << 20)
+#endif
+#ifndef KILO_INDEX_GROUP_SHIFT
+#define KILO_INDEX_GROUP_SHIFT 4
+#endif
+// longest a keypress may spend re-highlighting; the rest is done in slices of
+// the same length while waiting for the next key
+#ifndef KILO_HL_BUDGET_MS
+#define KILO_HL_BUDGET_MS 5
+#endif
+// most bytes a save hands to one writev()
+#ifndef KILO_SAVE_CHUNK
+#define KILO_SAVE_CHUNK (4 << 20)
+#endif
+// most input bytes read at once, e.g. of a paste
+#ifndef KILO_INPUT_BYTES
+#define KILO_INPUT_BYTES 4096
+#endif
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
@@ -45,6 +97,8 @@ enum EDITOR_KEY {
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,  // the text pasted follows, see `editor_read_paste()`
+    PASTE_END,    // the end of a paste whose start was not seen; ignored
 };
 
 enum EDITOR_HIGHLIGHT {
@@ -70,16 +124,90 @@ struct editor_syntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    // compiled from the fields above once the syntax is first selected
+    struct lexer *lexer;
 };
 
 struct editor_row {
-    int row_idx;  // the row's index within the file
     int size;
     int rsize;    // size of render
-    char *chars;  // dynamically allocated
+    char *chars;  // dynamically allocated, or borrowed from `E.map`
+    // `render` and `hl` are caches built when the row is drawn or searched,
+    // and dropped whenever `chars` changes; NULL while not built
     char *render;
     unsigned char *hl;  // highlighting, array of enum EDITOR_HIGHLIGHT
+    // comment state entering and leaving the row, as of its current `chars`
+    // if `hl_state_valid`; `hl` is always computed from `hl_in_comment`
+    int hl_in_comment;
     int hl_open_comment;
+    int hl_state_valid;
+    int mapped;  // `chars` points into `E.map`; not owned, not '\0'-terminated
+    int shared;  // `chars` may be in a snapshot; copied before any edit
+    uint32_t id;  // what the trigram index knows the row's text as
+};
+
+/**
+ * Rows are stored in a counted B+tree: leaves hold runs of `struct
+ * editor_row`, inner nodes hold their children, and every node knows how many
+ * rows live below it. Looking up, inserting and deleting the row at an index
+ * are all O(log n), and a row's index is simply its position in the tree.
+ */
+#define ROW_TREE_LEAF_CAP 64
+#define ROW_TREE_NODE_CAP 32
+
+struct row_node {
+    int is_leaf;
+    int n;      // number of rows (leaf) or children (inner node)
+    int count;  // number of rows in this subtree
+    union {
+        struct editor_row rows[ROW_TREE_LEAF_CAP];
+        struct row_node *children[ROW_TREE_NODE_CAP];
+    };
+};
+
+/**
+ * Input read from the terminal but not yet handled, from `start` to `end`
+ */
+struct input_buffer {
+    char buf[KILO_INPUT_BYTES];
+    int start;
+    int end;
+};
+
+struct row_tree {
+    struct row_node *root;
+    // the last leaf looked up and the index of its first row, so walking the
+    // rows in order costs O(1) per row; reset on every insert/delete
+    struct row_node *leaf;
+    int leaf_start;
+};
+
+/**
+ * The looks a screen cell can have: the default, the SGR foreground colors
+ * 30 to 37, and each of those inverted
+ */
+#define STYLE_DEFAULT 0
+#define STYLE_INVERSE 9  // added to one of the looks before it to invert it
+#define STYLE_COUNT 18
+
+/**
+ * A screen's worth of cells, each a byte and a style, kept apart so that a
+ * run of bytes can be copied in one go. A row holding non-ASCII bytes is
+ * `wide`: the terminal may show those in fewer columns than bytes, so such
+ * rows are only ever redrawn whole.
+ */
+struct frame {
+    int rows, cols;
+    char *chars;
+    unsigned char *styles;
+    unsigned char *wide;
+    int cap_cells, cap_rows;  // what the arrays have room for
+};
+
+// where the terminal's cursor is and the style it writes in; -1 if unknown
+struct frame_pen {
+    int y, x;
+    int style;
 };
 
 // Global state of the editor
@@ -91,12 +219,50 @@ struct editor_config {
     int screen_rows;
     int screen_cols;
     int num_rows;
+    // rows above this one have comment states consistent with the rows before
+    // them; highlighting resumes from here rather than from row 0
+    int hl_horizon;
+    // a drawn row was highlighted from a guessed state, to be redrawn once
+    // background highlighting has caught up with the screen
+    int hl_guessed;
     int dirty;
     char *filename;
     char status_msg[80];
     time_t status_msg_time;
-    struct editor_row *rows;
+    // read-only mapping of the opened file, which unedited rows borrow from
+    char *map;
+    size_t map_len;
+    int open_pending;  // see `editor_open_finish()`
+    struct row_tree rows;
+    // bumped on every edit
+    unsigned long version;
+    uint64_t edited_ns;  // `now_ns()` at the last edit
+    // the latest snapshot, while no edit has made it stale
+    struct snapshot *snapshot;
+    int snapshots_live;
+    // row buffers, freed once no snapshot is live
+    char **retired;
+    int n_retired;
+    int cap_retired;
+    // the trigram index of the file once built, and of the rows changed
+    // since it was started
+    struct trigram_index *index;
+    struct trigram_index *index_edits;
+    struct index_build *index_build;  // while being built
+    struct save_job *save;            // while a save is running
+    uint32_t next_row_id;
     struct editor_syntax *syntax;
+    int find_ignore_case;  // toggled with Ctrl-T while searching
+    int find_regex;        // toggled with Ctrl-E while searching
+    // the screen as drawn for the next refresh, and as the terminal shows it
+    struct frame frame;
+    struct frame shown;
+    int shown_valid;  // 0 when what the terminal shows is unknown
+    int shown_rowoff;  // the `rowoff` the terminal shows the text at
+    struct frame_pen pen;
+    // the terminal can be told to show a frame only once all of it is drawn
+    int sync_output;
+    struct input_buffer input;
     struct termios orig_termios;
 };
 struct editor_config E;
@@ -121,20 +287,64 @@ struct editor_syntax HLDB[] = {
         "/*",
         "*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL,
     },
 };
 
 // length of the HLDB array
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// syntaxes loaded from files at startup, tried before HLDB
+struct editor_syntax *syntax_db = NULL;
+int syntax_db_len = 0;
+
 /*** prototypes ***/
 
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen();
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
+int editor_hl_pending();
+void editor_hl_step();
+int editor_find_pending();
+void editor_find_step();
+int editor_open_finish();
+int editor_find_count_poll();
+uint64_t editor_find_count_due();
+int editor_index_poll();
+int editor_save_poll();
 
 /*** util ***/
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024  // as on Linux, macOS and the BSDs
+#endif
+
+/**
+ * Write all of the `iovcnt` buffers in `iov` to `fd`, carrying on after
+ * partial writes and interrupting signals; `iov` is used up on the way.
+ * Returns 0, or -1 with `errno` set.
+ */
+int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // skip what was written, which may end partway into a buffer
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
 void die(const char *s) {
     // clear the screen and reposition the cursor on exit
     int x = write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -146,771 +356,5402 @@ void die(const char *s) {
     exit(1);
 }
 
-/*** terminal ***/
+/**
+ * Monotonic clock in nanoseconds, for timing work
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 /**
- * Turn off raw mode
+ * `n_tasks` calls of `fn(arg, task)`, shared out among `n_threads` threads
+ * (the calling one included)
  */
-void disable_raw_mode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
-        die("tcsetattr");
+struct worker_pool_job {
+    void (*fn)(void *arg, int task);
+    void *arg;
+    int n_tasks;
+    int next_task;
+};
+
+void *worker_pool_thread(void *job_arg) {
+    struct worker_pool_job *job = job_arg;
+    int task;
+    while ((task = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED)) <
+           job->n_tasks) {
+        job->fn(job->arg, task);
+    }
+    return NULL;
+}
+
+void worker_pool_run(int n_threads, int n_tasks,
+                     void (*fn)(void *arg, int task), void *arg) {
+    struct worker_pool_job job = {fn, arg, n_tasks, 0};
+    if (n_threads > n_tasks) n_threads = n_tasks;
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    int started = 0;
+    for (int j = 1; j < n_threads; j++) {
+        if (pthread_create(&threads[started], NULL, worker_pool_thread,
+                           &job) == 0) {
+            started++;
+        }
+    }
+    worker_pool_thread(&job);
+    for (int j = 0; j < started; j++) {
+        pthread_join(threads[j], NULL);
     }
+    free(threads);
 }
 
 /**
- * Turn off the ECHO feature of the terminal
+ * Number of threads worth running CPU-bound work on
  */
-void enable_raw_mode() {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
-        // invalid ioctl
-        die("tcgetattr");
+int worker_pool_size() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > 64 ? 64 : n;
+}
+
+/*** row tree ***/
+
+struct row_node *row_node_new(int is_leaf) {
+    struct row_node *node = calloc(1, sizeof(struct row_node));
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+void row_tree_init(struct row_tree *t) {
+    t->root = row_node_new(1);
+    t->leaf = NULL;
+    t->leaf_start = 0;
+}
+
+/**
+ * Return the row at index `at`, or NULL if out of range.
+ * The pointer stays valid until the next insert or delete.
+ */
+struct editor_row *row_tree_get(struct row_tree *t, int at) {
+    if (at < 0 || at >= t->root->count) {
+        return NULL;
+    }
+    if (t->leaf && at >= t->leaf_start && at < t->leaf_start + t->leaf->n) {
+        return &t->leaf->rows[at - t->leaf_start];
     }
-    atexit(disable_raw_mode);
 
-    struct termios raw = E.orig_termios;
-    raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    // c_lflag - local modes
-    // ECHO - a bitflag
-    //   - 00000000000000000000000000001000 in binary
-    raw.c_lflag &=
-        ~(ECHO | ICANON | ISIG | IEXTEN);  // turn off ECHO _and_ Canonical mode
+    struct row_node *node = t->root;
+    int start = 0;
+    while (!node->is_leaf) {
+        int i = 0;
+        while (at - start >= node->children[i]->count) {
+            start += node->children[i]->count;
+            i++;
+        }
+        node = node->children[i];
+    }
+    t->leaf = node;
+    t->leaf_start = start;
+    return &node->rows[at - start];
+}
 
-    // `cc` - control characters, array of bytes that control terminal settings
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;  // 1/10 of a second
-    // TCSAFLUSH - how/when the changes take effect
-    //  - waits for all pending output to be written to terminal
-    //  - discards any input not read yet
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-        die("tcsetattr");
+/**
+ * Move the upper half of a full `node` into a new right sibling
+ */
+struct row_node *row_node_split(struct row_node *node) {
+    struct row_node *sib = row_node_new(node->is_leaf);
+    if (node->is_leaf) {
+        int half = ROW_TREE_LEAF_CAP / 2;
+        sib->n = node->n - half;
+        memcpy(sib->rows, &node->rows[half],
+               sizeof(struct editor_row) * sib->n);
+        sib->count = sib->n;
+        node->n = half;
+        node->count = half;
+    } else {
+        int half = ROW_TREE_NODE_CAP / 2;
+        sib->n = node->n - half;
+        memcpy(sib->children, &node->children[half],
+               sizeof(struct row_node *) * sib->n);
+        for (int i = 0; i < sib->n; i++) {
+            sib->count += sib->children[i]->count;
+        }
+        node->n = half;
+        node->count -= sib->count;
     }
+    return sib;
 }
 
 /**
- * Wait for one keypress, then return it
+ * Insert a zeroed row at `at` below `node`, storing its address in `slot`.
+ * Returns the new right sibling if `node` had to be split, NULL otherwise.
  */
-int editor_read_key() {
-    int n_read;
-    char c;
-    // read() returns -1 on failure
-    while ((n_read = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (n_read == -1 && errno != EAGAIN) {
-            die("read");
+struct row_node *row_node_insert(struct row_node *node, int at,
+                                 struct editor_row **slot) {
+    struct row_node *sib = NULL;
+    if (node->is_leaf) {
+        if (node->n == ROW_TREE_LEAF_CAP) {
+            sib = row_node_split(node);
+            if (at > node->n) {
+                at -= node->n;
+                node = sib;
+            }
         }
+        memmove(&node->rows[at + 1], &node->rows[at],
+                sizeof(struct editor_row) * (node->n - at));
+        memset(&node->rows[at], 0, sizeof(struct editor_row));
+        node->n++;
+        node->count++;
+        *slot = &node->rows[at];
+        return sib;
     }
 
-    // Map arrow keys to j/h/k/l
-    // arrow key presses are interpreted as an escape sequence
-    // `'\x1b'`, `[`, followed by
-    //   - `'A'`
-    //   - `'B'`
-    //   - `'C'`
-    //   - `'D'`
-    if (c == '\x1b') {
-        char seq[3];
+    // the last child also takes inserts at the very end of the subtree
+    int i = 0;
+    while (i < node->n - 1 && at > node->children[i]->count) {
+        at -= node->children[i]->count;
+        i++;
+    }
+    node->count++;
+    struct row_node *child_sib = row_node_insert(node->children[i], at, slot);
+    if (child_sib == NULL) {
+        return NULL;
+    }
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    // hook the child's new sibling in right after it
+    i++;
+    struct row_node *parent = node;
+    if (node->n == ROW_TREE_NODE_CAP) {
+        sib = row_node_split(node);
+        if (i > node->n) {
+            i -= node->n;
+            parent = sib;
+            // the split counted the new child's rows on the left side
+            node->count -= child_sib->count;
+            sib->count += child_sib->count;
+        }
+    }
+    memmove(&parent->children[i + 1], &parent->children[i],
+            sizeof(struct row_node *) * (parent->n - i));
+    parent->children[i] = child_sib;
+    parent->n++;
+    return sib;
+}
 
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1':
-                            return HOME_KEY;
-                        case '3':
-                            return DEL_KEY;
-                        case '4':
-                            return END_KEY;
-                        case '5':
-                            return PAGE_UP;
-                        case '6':
-                            return PAGE_DOWN;
-                        case '7':
-                            return HOME_KEY;
-                        case '8':
-                            return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A':
-                        return ARROW_UP;
-                    case 'B':
-                        return ARROW_DOWN;
-                    case 'C':
-                        return ARROW_RIGHT;
-                    case 'D':
-                        return ARROW_LEFT;
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
+/**
+ * Insert a zeroed row at index `at` and return it
+ */
+struct editor_row *row_tree_insert(struct row_tree *t, int at) {
+    struct editor_row *row;
+    struct row_node *sib = row_node_insert(t->root, at, &row);
+    if (sib) {
+        // grow the tree by one level
+        struct row_node *root = row_node_new(0);
+        root->n = 2;
+        root->children[0] = t->root;
+        root->children[1] = sib;
+        root->count = t->root->count + sib->count;
+        t->root = root;
+    }
+    t->leaf = NULL;
+    return row;
+}
+
+/**
+ * Fill an empty tree with `n` zeroed rows, building it bottom up from full
+ * leaves rather than inserting the rows one at a time
+ */
+void row_tree_load(struct row_tree *t, int n) {
+    int n_nodes = (n + ROW_TREE_LEAF_CAP - 1) / ROW_TREE_LEAF_CAP;
+    t->leaf = NULL;
+    if (n_nodes <= 1) {
+        t->root->n = n;
+        t->root->count = n;
+        return;
+    }
+    // rows, then children, are spread evenly so that no node is left nearly
+    // empty
+    struct row_node **level = malloc(sizeof(struct row_node *) * n_nodes);
+    for (int j = 0; j < n_nodes; j++) {
+        level[j] = row_node_new(1);
+        level[j]->n = (long)n * (j + 1) / n_nodes - (long)n * j / n_nodes;
+        level[j]->count = level[j]->n;
+    }
+    while (n_nodes > 1) {
+        int n_parents = (n_nodes + ROW_TREE_NODE_CAP - 1) / ROW_TREE_NODE_CAP;
+        for (int j = 0; j < n_parents; j++) {
+            struct row_node *parent = row_node_new(0);
+            int from = (long)n_nodes * j / n_parents;
+            int to = (long)n_nodes * (j + 1) / n_parents;
+            for (int k = from; k < to; k++) {
+                parent->children[parent->n++] = level[k];
+                parent->count += level[k]->count;
             }
+            level[j] = parent;  // `from` is never below `j`
         }
+        n_nodes = n_parents;
+    }
+    free(t->root);
+    t->root = level[0];
+    free(level);
+}
 
-        return '\x1b';
+/**
+ * Fold `node->children[i + 1]` into `node->children[i]`
+ */
+void row_node_merge(struct row_node *node, int i) {
+    struct row_node *left = node->children[i];
+    struct row_node *right = node->children[i + 1];
+    if (left->is_leaf) {
+        memcpy(&left->rows[left->n], right->rows,
+               sizeof(struct editor_row) * right->n);
     } else {
-        return c;
+        memcpy(&left->children[left->n], right->children,
+               sizeof(struct row_node *) * right->n);
     }
+    left->n += right->n;
+    left->count += right->count;
+    free(right);
+    memmove(&node->children[i + 1], &node->children[i + 2],
+            sizeof(struct row_node *) * (node->n - i - 2));
+    node->n--;
 }
 
-int get_cursor_position(int *rows, int *cols) {
-    // the `n` command - query terminal for status info
-    // response should be CPR (cursor position report)
-    //   - `Esc [ Pn;Pn R`
+void row_node_delete(struct row_node *node, int at) {
+    node->count--;
+    if (node->is_leaf) {
+        memmove(&node->rows[at], &node->rows[at + 1],
+                sizeof(struct editor_row) * (node->n - at - 1));
+        node->n--;
+        return;
+    }
 
-    char buf[32];
-    unsigned int i = 0;
+    int i = 0;
+    while (at >= node->children[i]->count) {
+        at -= node->children[i]->count;
+        i++;
+    }
+    struct row_node *child = node->children[i];
+    row_node_delete(child, at);
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+    // keep nodes reasonably full so the tree stays shallow
+    int cap = child->is_leaf ? ROW_TREE_LEAF_CAP : ROW_TREE_NODE_CAP;
+    if (child->n >= cap / 4 || node->n == 1) {
+        return;
+    }
+    if (i + 1 < node->n && child->n + node->children[i + 1]->n <= cap) {
+        row_node_merge(node, i);
+    } else if (i > 0 && node->children[i - 1]->n + child->n <= cap) {
+        row_node_merge(node, i - 1);
+    } else if (child->n == 0) {
+        free(child);
+        memmove(&node->children[i], &node->children[i + 1],
+                sizeof(struct row_node *) * (node->n - i - 1));
+        node->n--;
+    }
+}
 
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-        if (buf[i] == 'R') break;
-        ++i;
+/**
+ * Remove the row at index `at`; the caller frees what the row owns
+ */
+void row_tree_delete(struct row_tree *t, int at) {
+    row_node_delete(t->root, at);
+    while (!t->root->is_leaf && t->root->n == 1) {
+        // drop a level once the root has a single child
+        struct row_node *root = t->root;
+        t->root = root->children[0];
+        free(root);
     }
-    buf[i] = '\0';
+    t->leaf = NULL;
+}
 
-    if (buf[0] != '\x1b' || buf[1] != '[') {
-        return -1;
+/**
+ * The row at index `at` of the file being edited, NULL past the last row
+ */
+struct editor_row *editor_row_at(int at) { return row_tree_get(&E.rows, at); }
+
+/*** line scanning ***/
+
+/**
+ * Where each line of a buffer starts. Line `i` runs from `starts[i]` up to
+ * `starts[i + 1]` (or the end of the buffer), including its newline.
+ */
+struct line_index {
+    size_t *starts;
+    size_t count;
+    size_t cap;
+};
+
+void line_index_push(struct line_index *idx, size_t start) {
+    if (idx->count == idx->cap) {
+        idx->cap = idx->cap ? idx->cap * 2 : 1024;
+        idx->starts = realloc(idx->starts, sizeof(size_t) * idx->cap);
     }
-    // skipping '\x1b' and '['
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
-        // parse two integers separated by ';'
-        return -1;
+    idx->starts[idx->count++] = start;
+}
+
+/**
+ * Record the start of the line after every '\n' in `buf[from, len)`
+ */
+void scan_newlines_scalar(struct line_index *idx, const char *buf,
+                          size_t from, size_t len) {
+    const char *p = buf + from;
+    const char *end = buf + len;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        line_index_push(idx, p - buf);
     }
+}
 
-    return 0;
+#ifdef KILO_X86
+/**
+ * Compare 16 bytes at a time against '\n' and walk the set bits of the mask
+ */
+__attribute__((target("sse2"))) void scan_newlines_sse2(
+    struct line_index *idx, const char *buf, size_t from, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        while (mask) {
+            line_index_push(idx, i + __builtin_ctz(mask) + 1);
+            mask &= mask - 1;  // clear the lowest set bit
+        }
+    }
+    scan_newlines_scalar(idx, buf, i, len);
 }
 
-int get_window_size(int *rows, int *cols) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        // 1. move cursor to bottom right corner
-        // 2. get cursor position
-        // the `C` command - moves cursor to the right
-        // the `B` command - moves cursor down
-        // do _NOT_ use the `H` command like `999;999H` because it does not
-        // specify what happens if moving pass screen edge
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-            return -1;
+__attribute__((target("avx2"))) void scan_newlines_avx2(
+    struct line_index *idx, const char *buf, size_t from, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+        while (mask) {
+            line_index_push(idx, i + __builtin_ctz(mask) + 1);
+            mask &= mask - 1;
         }
-        return get_cursor_position(rows, cols);
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
     }
+    scan_newlines_scalar(idx, buf, i, len);
 }
+#endif
 
-/*** syntax highlighting ***/
+typedef void (*scan_newlines_fn)(struct line_index *, const char *, size_t,
+                                 size_t);
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+/**
+ * The widest newline scanner the CPU we are running on supports
+ */
+scan_newlines_fn scan_newlines_best(const char **name) {
+#ifdef KILO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return scan_newlines_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return scan_newlines_sse2;
+    }
+#endif
+    *name = "scalar";
+    return scan_newlines_scalar;
 }
 
 /**
- * Go through all chars in an editor_row and
- * highlight them by setting each value in the hl array
+ * Build the line-start table of `buf` in one pass. A trailing newline does
+ * not start another (empty) line, same as reading the buffer with getline().
  */
-void editor_update_syntax(struct editor_row *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL) {
+void line_index_scan_with(struct line_index *idx, const char *buf,
+                          size_t len, scan_newlines_fn scan) {
+    idx->count = 0;
+    if (len == 0) {
         return;
     }
+    line_index_push(idx, 0);
+    scan(idx, buf, 0, len);
+    if (idx->starts[idx->count - 1] == len) {
+        idx->count--;
+    }
+}
 
-    char **reserveds = E.syntax->reserveds;
+void line_index_scan(struct line_index *idx, const char *buf, size_t len) {
+    static scan_newlines_fn scan = NULL;
+    if (scan == NULL) {
+        const char *name;
+        scan = scan_newlines_best(&name);
+    }
+    line_index_scan_with(idx, buf, len, scan);
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+/**
+ * Length of line `i` without its newline and any carriage returns before it
+ */
+size_t line_index_line_len(struct line_index *idx, const char *buf,
+                           size_t len, size_t i) {
+    size_t start = idx->starts[i];
+    size_t end = (i + 1 < idx->count) ? idx->starts[i + 1] - 1 : len;
+    if (end == len && end > start && buf[end - 1] == '\n') {
+        end--;
+    }
+    while (end > start && buf[end - 1] == '\r') {
+        end--;
+    }
+    return end - start;
+}
 
-    // beginning of a line is separator
-    int prev_sep = 1;
+void line_index_free(struct line_index *idx) {
+    free(idx->starts);
+    idx->starts = NULL;
+    idx->count = 0;
+    idx->cap = 0;
+}
 
-    int in_string = 0;
-    // true if the previous row has unclosed multiline comment
-    int in_comment =
-        (row->row_idx > 0 && E.rows[row->row_idx - 1].hl_open_comment);
+/*** substring search ***/
 
-    int i = 0;
-    // while loops allows us to consume multiple chars each iteration
-    while (i < row->rsize) {
-        char c = row->render[i];
-        // highlight type of previous character
-        // previous highlight type either a number or separator
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+/**
+ * A search query prepared for `search_*`. When ignoring case, `s` holds the
+ * query in lower case and haystack bytes are folded as they are compared,
+ * so rows never need copying.
+ */
+struct search_needle {
+    char *s;
+    int len;
+    int ignore_case;
+    // first and last byte of `s`, and what to OR haystack bytes with before
+    // comparing them: 0x20 folds ASCII letters to lower case
+    unsigned char first, last;
+    unsigned char first_fold, last_fold;
+    struct regex *re;  // for a regular expression, else NULL
+};
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_ML_COMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    // if at end of multiline comment
-                    memset(&row->hl[i], HL_ML_COMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                // just entering multiline comment
-                // at the beginning of the multiline comment
-                memset(&row->hl[i], HL_ML_COMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
+typedef int (*search_fn)(const char *, int, const struct search_needle *);
+
+search_fn search_best(const char **name);
+void regex_free(struct regex *re);
+
+// picked when the first needle is prepared, before any worker thread reads it
+search_fn search_impl = NULL;
+
+void search_needle_init(struct search_needle *n, const char *query,
+                        int ignore_case) {
+    if (search_impl == NULL) {
+        const char *name;
+        search_impl = search_best(&name);
+    }
+    n->len = strlen(query);
+    n->s = malloc(n->len + 1);
+    for (int j = 0; j <= n->len; j++) {
+        n->s[j] = ignore_case ? tolower((unsigned char)query[j]) : query[j];
+    }
+    n->ignore_case = ignore_case;
+    n->re = NULL;
+    if (n->len == 0) {
+        return;
+    }
+    n->first = n->s[0];
+    n->last = n->s[n->len - 1];
+    n->first_fold = (ignore_case && isalpha(n->first)) ? 0x20 : 0;
+    n->last_fold = (ignore_case && isalpha(n->last)) ? 0x20 : 0;
+}
+
+void search_needle_free(struct search_needle *n) {
+    free(n->s);
+    n->s = NULL;
+    regex_free(n->re);
+    n->re = NULL;
+}
+
+/**
+ * Whether the needle is at `p`, given that its first and last bytes are
+ */
+int search_verify(const char *p, const struct search_needle *n) {
+    if (!n->ignore_case) {
+        return n->len <= 2 || !memcmp(p + 1, n->s + 1, n->len - 2);
+    }
+    for (int k = 1; k < n->len - 1; k++) {
+        if (tolower((unsigned char)p[k]) != (unsigned char)n->s[k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Offset of the first match of `n` in `hay[from, len)`, or -1
+ */
+int search_scalar_from(const char *hay, int len, int from,
+                       const struct search_needle *n) {
+    for (int i = from; i + n->len <= len; i++) {
+        if (!n->ignore_case) {
+            // let memchr skip ahead to the next candidate
+            const char *p = memchr(hay + i, n->first, len - n->len + 1 - i);
+            if (p == NULL) {
+                return -1;
             }
+            i = p - hay;
+        }
+        if (((unsigned char)hay[i] | n->first_fold) == n->first &&
+            ((unsigned char)hay[i + n->len - 1] | n->last_fold) == n->last &&
+            search_verify(hay + i, n)) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    // when `\'` or `\"`
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) {
-                    // if current character is the closing quote
-                    in_string = 0;
-                }
-                i++;
-                // when finished highlighting, the closing quote considered
-                // a separator
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;  // store closing/opening quote
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
+int search_scalar(const char *hay, int len, const struct search_needle *n) {
+    return search_scalar_from(hay, len, 0, n);
+}
+
+#ifdef KILO_X86
+/**
+ * Compare 16 positions at a time against both the first and the last byte of
+ * the needle, and verify only the positions where both agree
+ */
+__attribute__((target("sse2"))) int search_sse2(
+    const char *hay, int len, const struct search_needle *n) {
+    const __m128i first = _mm_set1_epi8(n->first);
+    const __m128i last = _mm_set1_epi8(n->last);
+    const __m128i first_fold = _mm_set1_epi8(n->first_fold);
+    const __m128i last_fold = _mm_set1_epi8(n->last_fold);
+    int i = 0;
+    for (; i + n->len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + n->len - 1));
+        __m128i eq =
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(a, first_fold), first),
+                          _mm_cmpeq_epi8(_mm_or_si128(b, last_fold), last));
+        unsigned mask = _mm_movemask_epi8(eq);
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (search_verify(hay + at, n)) {
+                return at;
             }
+            mask &= mask - 1;
         }
+    }
+    return search_scalar_from(hay, len, i, n);
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;  // in the middle of highlighting something
+__attribute__((target("avx2"))) int search_avx2(
+    const char *hay, int len, const struct search_needle *n) {
+    const __m256i first = _mm256_set1_epi8(n->first);
+    const __m256i last = _mm256_set1_epi8(n->last);
+    const __m256i first_fold = _mm256_set1_epi8(n->first_fold);
+    const __m256i last_fold = _mm256_set1_epi8(n->last_fold);
+    int i = 0;
+    for (; i + n->len - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b =
+            _mm256_loadu_si256((const __m256i *)(hay + i + n->len - 1));
+        __m256i eq = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(a, first_fold), first),
+            _mm256_cmpeq_epi8(_mm256_or_si256(b, last_fold), last));
+        unsigned mask = _mm256_movemask_epi8(eq);
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (search_verify(hay + at, n)) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_scalar_from(hay, len, i, n);
+}
+#endif
+
+
+/**
+ * The widest substring search the CPU we are running on supports
+ */
+search_fn search_best(const char **name) {
+#ifdef KILO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return search_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return search_sse2;
+    }
+#endif
+    *name = "scalar";
+    return search_scalar;
+}
+
+/**
+ * Offset of the first match of `n` in `hay[0, len)`, or -1. An empty needle
+ * matches nothing.
+ */
+int search_first(const char *hay, int len, const struct search_needle *n) {
+    if (n->len == 0 || n->len > len) {
+        return -1;
+    }
+    return search_impl(hay, len, n);
+}
+
+/*** regular expressions ***/
+
+/**
+ * Patterns are compiled to a Thompson NFA, a program for a Pike VM, so that
+ * matching takes time linear in the row whatever the pattern; nothing ever
+ * backtracks. Whether a row matches at all is answered by a DFA built from
+ * the same program a state at a time, as rows need it. Every match of a
+ * pattern starting with a literal begins with that literal, so both skip
+ * ahead to its next occurrence with `search_first` whenever no match is in
+ * progress.
+ *
+ * Supported: literals, `.`, `[...]` and `[^...]`, `\d \w \s \D \W \S`,
+ * `\t \n \r`, anchors `^ $ \b \B`, groups `(...)` and `(?:...)`, `|`, and
+ * `* + ? {m} {m,} {m,n}`, each lazy with a trailing `?`.
+ */
+
+#define REGEX_MAX_INSTS 10000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_DEPTH 200
+#define REGEX_MAX_PREFIX 64
+// memory the DFA may take before it is thrown away and rebuilt
+#define REGEX_CACHE_BYTES (1 << 20)
+
+enum regex_op {
+    RE_CLASS = 0,  // consume a byte in class `x`
+    RE_MATCH,
+    RE_JMP,    // go to `x`
+    RE_SPLIT,  // go to `x`, and with lower priority to `y`
+    RE_BOL,
+    RE_EOL,
+    RE_WORDB,
+    RE_NWORDB
+};
+
+struct regex_inst {
+    int op;
+    int x, y;
+};
+
+enum regex_node_type {
+    RN_EMPTY = 0,
+    RN_CLASS,  // `cls`; a single byte `lit` if not -1
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,  // `a` between `min` and `max` (-1 for no limit) times
+    RN_ASSERT   // `op`, one of the zero-width instructions
+};
+
+struct regex_node {
+    int type;
+    int a, b;
+    int cls, lit;
+    int min, max, greedy;
+    int op;
+};
+
+/**
+ * A DFA state: the instructions the NFA may be at, after following jumps
+ * and splits; `RE_EOL` is left to be resolved at the end of the row
+ */
+struct regex_state {
+    int *pcs;
+    int n_pcs;
+    int *next;  // by byte class; -1 until computed
+    int match;
+};
+
+struct regex_thread {
+    int pc;
+    int start;
+};
+
+struct regex_list {
+    struct regex_thread *threads;
+    int n;
+    // every instruction visited at this position, threads or not
+    int *sparse, *dense;
+    int n_seen;
+};
+
+struct regex {
+    struct regex_inst *prog;
+    int n_prog;
+    unsigned char (*classes)[32];  // bitsets over bytes
+    int n_classes;
+    // bytes no class tells apart share a DFA transition
+    unsigned char byte_class[256];
+    unsigned char class_byte[256];  // a byte of each
+    int n_byte_classes;
+    int anchored;  // can only match at the start of a row
+    int word_boundary;  // uses \b or \B, which the DFA cannot
+    struct search_needle prefix;  // every match starts with this
+    // scratch for the Pike VM, and for building the DFA
+    struct regex_list lists[2];
+    int *stack;
+    int *seeds;
+    // the DFA built so far
+    struct regex_state *states;
+    int n_states;
+    int cap_states;
+    size_t cache_bytes;
+    int *table;  // state indexes + 1 by hash of their instructions, 0 if free
+    int table_cap;
+    int start_bol, start;  // starting states at the row start and elsewhere
+};
+
+struct regex_parser {
+    const char *p;
+    int ignore_case;
+    struct regex *re;
+    struct regex_node *nodes;
+    int n_nodes;
+    int cap_nodes;
+    int depth;
+    const char *error;
+};
+
+int regex_node_new(struct regex_parser *ps, int type) {
+    if (ps->n_nodes == ps->cap_nodes) {
+        ps->cap_nodes = ps->cap_nodes ? ps->cap_nodes * 2 : 32;
+        ps->nodes =
+            realloc(ps->nodes, sizeof(struct regex_node) * ps->cap_nodes);
+    }
+    struct regex_node *node = &ps->nodes[ps->n_nodes];
+    memset(node, 0, sizeof(struct regex_node));
+    node->type = type;
+    node->lit = -1;
+    return ps->n_nodes++;
+}
+
+int regex_class_new(struct regex *re) {
+    re->classes =
+        realloc(re->classes, sizeof(re->classes[0]) * (re->n_classes + 1));
+    memset(re->classes[re->n_classes], 0, sizeof(re->classes[0]));
+    return re->n_classes++;
+}
+
+void regex_class_add(unsigned char *set, int from, int to) {
+    for (int c = from; c <= to; c++) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+int regex_class_has(const unsigned char *set, int c) {
+    return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+int regex_is_word(int c) { return isalnum(c) || c == '_'; }
+
+/**
+ * Add the bytes of `\d`, `\w` or `\s` (or their complements, in upper case)
+ * to `set`. Returns 0 if `c` names none of them.
+ */
+int regex_class_escape(unsigned char *set, int c) {
+    int (*is)(int);
+    switch (tolower(c)) {
+        case 'd':
+            is = isdigit;
+            break;
+        case 'w':
+            is = regex_is_word;
+            break;
+        case 's':
+            is = isspace;
+            break;
+        default:
+            return 0;
+    }
+    for (int b = 0; b < 256; b++) {
+        if (!is(b) == !!isupper(c)) {
+            regex_class_add(set, b, b);
+        }
+    }
+    return 1;
+}
+
+int regex_escape_byte(int c) {
+    switch (c) {
+        case 't':
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        default:
+            return c;
+    }
+}
+
+/**
+ * Make a class match both cases of every letter in it
+ */
+void regex_class_fold(unsigned char *set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (regex_class_has(set, c) || regex_class_has(set, toupper(c))) {
+            regex_class_add(set, c, c);
+            regex_class_add(set, toupper(c), toupper(c));
+        }
+    }
+}
+
+int regex_parse_alt(struct regex_parser *ps);
+
+int regex_parse_class(struct regex_parser *ps) {
+    int node = regex_node_new(ps, RN_CLASS);
+    int cls = regex_class_new(ps->re);
+    unsigned char *set = ps->re->classes[cls];
+    ps->nodes[node].cls = cls;
+
+    int negate = *ps->p == '^';
+    if (negate) ps->p++;
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        int from = (unsigned char)*ps->p++;
+        if (from == '\\' && *ps->p) {
+            int c = (unsigned char)*ps->p++;
+            if (regex_class_escape(set, c)) {
                 continue;
             }
+            from = regex_escape_byte(c);
+        }
+        int to = from;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ps->p++;
+            to = (unsigned char)*ps->p++;
+            if (to == '\\' && *ps->p) {
+                to = regex_escape_byte((unsigned char)*ps->p++);
+            }
+            if (to < from) {
+                ps->error = "bad range";
+                return -1;
+            }
+        }
+        regex_class_add(set, from, to);
+    }
+    if (*ps->p != ']') {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    if (ps->ignore_case) {
+        regex_class_fold(set);
+    }
+    if (negate) {
+        for (int j = 0; j < 32; j++) {
+            set[j] = ~set[j];
+        }
+    }
+    return node;
+}
+
+int regex_parse_atom(struct regex_parser *ps) {
+    int c = (unsigned char)*ps->p++;
+    int node;
+    switch (c) {
+        case '(':
+            if (++ps->depth > REGEX_MAX_DEPTH) {
+                ps->error = "nested too deep";
+                return -1;
+            }
+            if (ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            }
+            node = regex_parse_alt(ps);
+            if (node == -1) {
+                return -1;
+            }
+            if (*ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            ps->depth--;
+            return node;
+        case '[':
+            return regex_parse_class(ps);
+        case '^':
+        case '$':
+            node = regex_node_new(ps, RN_ASSERT);
+            ps->nodes[node].op = c == '^' ? RE_BOL : RE_EOL;
+            return node;
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            ps->error = "nothing to repeat";
+            return -1;
+    }
+
+    node = regex_node_new(ps, RN_CLASS);
+    int cls = regex_class_new(ps->re);
+    unsigned char *set = ps->re->classes[cls];
+    ps->nodes[node].cls = cls;
+    if (c == '.') {
+        regex_class_add(set, 0, 255);
+        return node;
+    }
+    if (c == '\\') {
+        if (*ps->p == '\0') {
+            ps->error = "trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (c == 'b' || c == 'B') {
+            ps->nodes[node].type = RN_ASSERT;
+            ps->nodes[node].op = c == 'b' ? RE_WORDB : RE_NWORDB;
+            ps->re->word_boundary = 1;
+            return node;
+        }
+        if (regex_class_escape(set, c)) {
+            return node;
+        }
+        c = regex_escape_byte(c);
+    }
+    regex_class_add(set, c, c);
+    ps->nodes[node].lit = c;
+    if (ps->ignore_case && isalpha(c)) {
+        regex_class_fold(set);
+        ps->nodes[node].lit = tolower(c);
+    }
+    return node;
+}
+
+/**
+ * Parse `{m}`, `{m,}` or `{m,n}` after the `{`. Returns 0 if it is not one.
+ */
+int regex_parse_braces(struct regex_parser *ps, int *min, int *max) {
+    const char *p = ps->p;
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    *min = strtol(p, (char **)&p, 10);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = isdigit((unsigned char)*p) ? strtol(p, (char **)&p, 10) : -1;
+    }
+    if (*p != '}') {
+        return 0;
+    }
+    ps->p = p + 1;
+    return 1;
+}
+
+int regex_parse_repeat(struct regex_parser *ps) {
+    int node = regex_parse_atom(ps);
+    while (node != -1) {
+        int min, max;
+        if (*ps->p == '*') {
+            min = 0, max = -1;
+        } else if (*ps->p == '+') {
+            min = 1, max = -1;
+        } else if (*ps->p == '?') {
+            min = 0, max = 1;
+        } else if (*ps->p == '{') {
+            ps->p++;
+            if (!regex_parse_braces(ps, &min, &max)) {
+                ps->error = "bad {}";
+                return -1;
+            }
+            if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT ||
+                (max != -1 && max < min)) {
+                ps->error = "bad {}";
+                return -1;
+            }
+            ps->p--;
+        } else {
+            break;
+        }
+        ps->p++;
+        int repeat = regex_node_new(ps, RN_REPEAT);
+        ps->nodes[repeat].a = node;
+        ps->nodes[repeat].min = min;
+        ps->nodes[repeat].max = max;
+        ps->nodes[repeat].greedy = 1;
+        if (*ps->p == '?') {
+            ps->nodes[repeat].greedy = 0;
+            ps->p++;
+        }
+        node = repeat;
+    }
+    return node;
+}
+
+int regex_parse_cat(struct regex_parser *ps) {
+    int node = regex_node_new(ps, RN_EMPTY);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int next = regex_parse_repeat(ps);
+        if (next == -1) {
+            return -1;
+        }
+        int cat = regex_node_new(ps, RN_CAT);
+        ps->nodes[cat].a = node;
+        ps->nodes[cat].b = next;
+        node = cat;
+    }
+    return node;
+}
+
+int regex_parse_alt(struct regex_parser *ps) {
+    int node = regex_parse_cat(ps);
+    while (node != -1 && *ps->p == '|') {
+        ps->p++;
+        int next = regex_parse_cat(ps);
+        if (next == -1) {
+            return -1;
+        }
+        int alt = regex_node_new(ps, RN_ALT);
+        ps->nodes[alt].a = node;
+        ps->nodes[alt].b = next;
+        node = alt;
+    }
+    return node;
+}
+
+int regex_emit(struct regex *re, int op, int x, int y) {
+    if (re->n_prog == REGEX_MAX_INSTS) {
+        return -1;
+    }
+    re->prog[re->n_prog] = (struct regex_inst){op, x, y};
+    return re->n_prog++;
+}
+
+/**
+ * Emit the instructions of a node. Returns -1 if the program grows too big.
+ */
+int regex_compile_node(struct regex *re, struct regex_node *nodes, int i) {
+    struct regex_node *node = &nodes[i];
+    int split, jmp;
+    switch (node->type) {
+        case RN_EMPTY:
+            return 0;
+        case RN_CLASS:
+            return regex_emit(re, RE_CLASS, node->cls, 0) == -1 ? -1 : 0;
+        case RN_ASSERT:
+            return regex_emit(re, node->op, 0, 0) == -1 ? -1 : 0;
+        case RN_CAT:
+            if (regex_compile_node(re, nodes, node->a) == -1) return -1;
+            return regex_compile_node(re, nodes, node->b);
+        case RN_ALT:
+            if ((split = regex_emit(re, RE_SPLIT, 0, 0)) == -1) return -1;
+            re->prog[split].x = re->n_prog;
+            if (regex_compile_node(re, nodes, node->a) == -1) return -1;
+            if ((jmp = regex_emit(re, RE_JMP, 0, 0)) == -1) return -1;
+            re->prog[split].y = re->n_prog;
+            if (regex_compile_node(re, nodes, node->b) == -1) return -1;
+            re->prog[jmp].x = re->n_prog;
+            return 0;
+    }
+
+    // RN_REPEAT: the required copies, then a loop or the optional ones
+    for (int j = 0; j < node->min; j++) {
+        if (regex_compile_node(re, nodes, node->a) == -1) return -1;
+    }
+    int first_split = re->n_prog;
+    int copies = node->max == -1 ? 1 : node->max - node->min;
+    for (int j = 0; j < copies; j++) {
+        if ((split = regex_emit(re, RE_SPLIT, 0, 0)) == -1) return -1;
+        if (regex_compile_node(re, nodes, node->a) == -1) return -1;
+        if (node->max == -1 && regex_emit(re, RE_JMP, split, 0) == -1) {
+            return -1;
+        }
+    }
+    // every split goes on into the copy after it, or out past the last one;
+    // the splits still to patch are the ones pointing at 0
+    for (int pc = first_split; pc < re->n_prog; pc++) {
+        if (re->prog[pc].op == RE_SPLIT && re->prog[pc].x == 0 &&
+            re->prog[pc].y == 0) {
+            int body = pc + 1, out = re->n_prog;
+            re->prog[pc].x = node->greedy ? body : out;
+            re->prog[pc].y = node->greedy ? out : body;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Collect the literal bytes every match starts with. Returns whether all of
+ * node `i` was literal, so the bytes after it may be too.
+ */
+int regex_collect_prefix(char *prefix, struct regex_node *nodes, int i,
+                         int *len) {
+    struct regex_node *node = &nodes[i];
+    switch (node->type) {
+        case RN_EMPTY:
+            return 1;
+        case RN_CLASS:
+            if (node->lit == -1 || node->lit == 0 ||
+                *len == REGEX_MAX_PREFIX) {
+                return 0;
+            }
+            prefix[(*len)++] = node->lit;
+            return 1;
+        case RN_CAT:
+            return regex_collect_prefix(prefix, nodes, node->a, len) &&
+                   regex_collect_prefix(prefix, nodes, node->b, len);
+        case RN_REPEAT:
+            if (node->min > 0) {
+                regex_collect_prefix(prefix, nodes, node->a, len);
+            }
+            return 0;
+    }
+    return 0;
+}
+
+/**
+ * Split the bytes into classes that every class of the pattern either
+ * contains whole or not at all
+ */
+void regex_byte_classes(struct regex *re) {
+    memset(re->byte_class, 0, sizeof(re->byte_class));
+    re->n_byte_classes = 1;
+    for (int k = 0; k < re->n_classes; k++) {
+        // the new class of bytes in `k` that were in each old one
+        int split[256];
+        for (int j = 0; j < re->n_byte_classes; j++) split[j] = -1;
+        int n = re->n_byte_classes;
+        for (int c = 0; c < 256; c++) {
+            if (!regex_class_has(re->classes[k], c)) continue;
+            int old = re->byte_class[c];
+            if (split[old] == -1) split[old] = n++;
+            re->byte_class[c] = split[old];
+        }
+        re->n_byte_classes = n;
+        // renumber so that ids stay dense when a class took all of an old one
+        int renumber[256], used = 0;
+        for (int j = 0; j < n; j++) renumber[j] = -1;
+        for (int c = 0; c < 256; c++) {
+            int b = re->byte_class[c];
+            if (renumber[b] == -1) renumber[b] = used++;
+            re->byte_class[c] = renumber[b];
+        }
+        re->n_byte_classes = used;
+    }
+    for (int c = 255; c >= 0; c--) {
+        re->class_byte[re->byte_class[c]] = c;
+    }
+}
+
+/**
+ * Compile `pattern`. On a bad pattern returns NULL and sets `*error`.
+ */
+struct regex *regex_compile(const char *pattern, int ignore_case,
+                            const char **error) {
+    struct regex *re = calloc(1, sizeof(struct regex));
+    struct regex_parser ps = {.p = pattern, .ignore_case = ignore_case,
+                              .re = re};
+    int root = regex_parse_alt(&ps);
+    if (root != -1 && *ps.p == ')') {
+        ps.error = "unmatched )";
+    }
+    if (root == -1 || ps.error) {
+        *error = ps.error;
+        free(ps.nodes);
+        regex_free(re);
+        return NULL;
+    }
+
+    re->prog = malloc(sizeof(struct regex_inst) * REGEX_MAX_INSTS);
+    if (regex_compile_node(re, ps.nodes, root) == -1 ||
+        regex_emit(re, RE_MATCH, 0, 0) == -1) {
+        *error = "pattern too big";
+        free(ps.nodes);
+        regex_free(re);
+        return NULL;
+    }
+    char prefix[REGEX_MAX_PREFIX + 1];
+    int prefix_len = 0;
+    regex_collect_prefix(prefix, ps.nodes, root, &prefix_len);
+    prefix[prefix_len] = '\0';
+    search_needle_init(&re->prefix, prefix, ignore_case);
+    re->anchored = re->prog[0].op == RE_BOL;
+    free(ps.nodes);
+    regex_byte_classes(re);
+
+    for (int j = 0; j < 2; j++) {
+        struct regex_list *l = &re->lists[j];
+        l->threads = malloc(sizeof(struct regex_thread) * re->n_prog);
+        l->sparse = calloc(re->n_prog, sizeof(int));
+        l->dense = malloc(sizeof(int) * re->n_prog);
+    }
+    re->stack = malloc(sizeof(int) * (3 * re->n_prog + 2));
+    re->seeds = malloc(sizeof(int) * (re->n_prog + 1));
+    re->start_bol = re->start = -1;
+    return re;
+}
+
+void regex_cache_clear(struct regex *re) {
+    for (int j = 0; j < re->n_states; j++) {
+        free(re->states[j].pcs);
+        free(re->states[j].next);
+    }
+    re->n_states = 0;
+    re->cache_bytes = 0;
+    if (re->table) {
+        memset(re->table, 0, sizeof(int) * re->table_cap);
+    }
+    re->start_bol = re->start = -1;
+}
+
+void regex_free(struct regex *re) {
+    if (re == NULL) {
+        return;
+    }
+    regex_cache_clear(re);
+    free(re->states);
+    free(re->table);
+    for (int j = 0; j < 2; j++) {
+        free(re->lists[j].threads);
+        free(re->lists[j].sparse);
+        free(re->lists[j].dense);
+    }
+    free(re->stack);
+    free(re->seeds);
+    search_needle_free(&re->prefix);
+    free(re->classes);
+    free(re->prog);
+    free(re);
+}
+
+/**
+ * Mark `pc` seen in `l`. Returns 0 if it already was.
+ */
+int regex_list_see(struct regex_list *l, int pc) {
+    int k = l->sparse[pc];
+    if (k < l->n_seen && l->dense[k] == pc) {
+        return 0;
+    }
+    l->sparse[pc] = l->n_seen;
+    l->dense[l->n_seen++] = pc;
+    return 1;
+}
+
+/**
+ * Whether the zero-width instruction at `pc` holds at `pos`
+ */
+int regex_assert(struct regex_inst *inst, const char *hay, int len,
+                 int pos) {
+    int before = pos > 0 && regex_is_word((unsigned char)hay[pos - 1]);
+    int after = pos < len && regex_is_word((unsigned char)hay[pos]);
+    switch (inst->op) {
+        case RE_BOL:
+            return pos == 0;
+        case RE_EOL:
+            return pos == len;
+        case RE_WORDB:
+            return before != after;
+        default:
+            return before == after;
+    }
+}
+
+/**
+ * Add a thread at `pc` to `l`, following jumps, splits and assertions in
+ * priority order
+ */
+void regex_add_thread(struct regex *re, struct regex_list *l, int pc,
+                      int start, const char *hay, int len, int pos) {
+    int top = 0;
+    re->stack[top++] = pc;
+    while (top) {
+        pc = re->stack[--top];
+        if (!regex_list_see(l, pc)) {
+            continue;
+        }
+        struct regex_inst *inst = &re->prog[pc];
+        switch (inst->op) {
+            case RE_JMP:
+                re->stack[top++] = inst->x;
+                break;
+            case RE_SPLIT:
+                re->stack[top++] = inst->y;
+                re->stack[top++] = inst->x;
+                break;
+            case RE_CLASS:
+            case RE_MATCH:
+                l->threads[l->n++] = (struct regex_thread){pc, start};
+                break;
+            default:
+                if (regex_assert(inst, hay, len, pos)) {
+                    re->stack[top++] = pc + 1;
+                }
         }
+    }
+}
+
+/**
+ * Offset of the leftmost match starting at or after `from` in `hay[0, len)`,
+ * or -1; its end goes to `*end`. Of the matches starting there, the one
+ * found is the one a backtracking engine would find first.
+ */
+int regex_find(struct regex *re, const char *hay, int len, int from,
+               int *end) {
+    struct regex_list *clist = &re->lists[0], *nlist = &re->lists[1];
+    clist->n = clist->n_seen = 0;
+    int match = -1;
+    for (int pos = from; pos <= len; pos++) {
+        if (match == -1 && clist->n == 0) {
+            if (re->anchored && pos > 0) {
+                break;
+            }
+            if (re->prefix.len) {
+                int found = search_first(hay + pos, len - pos, &re->prefix);
+                if (found == -1) {
+                    break;
+                }
+                pos += found;
+            }
+        }
+        if (match == -1) {
+            // lower priority than any thread that started earlier
+            regex_add_thread(re, clist, 0, pos, hay, len, pos);
+        }
+        if (clist->n == 0 && match != -1) {
+            break;
+        }
+        nlist->n = nlist->n_seen = 0;
+        for (int t = 0; t < clist->n; t++) {
+            struct regex_thread *thread = &clist->threads[t];
+            struct regex_inst *inst = &re->prog[thread->pc];
+            if (inst->op == RE_MATCH) {
+                match = thread->start;
+                *end = pos;
+                break;  // the threads after it have lower priority
+            }
+            if (pos < len && regex_class_has(re->classes[inst->x],
+                                             (unsigned char)hay[pos])) {
+                regex_add_thread(re, nlist, thread->pc + 1, thread->start, hay,
+                                 len, pos + 1);
+            }
+        }
+        struct regex_list *swap = clist;
+        clist = nlist;
+        nlist = swap;
+    }
+    return match;
+}
+
+int regex_int_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Visit every instruction the `seeds` lead to without consuming a byte, at
+ * a position that is (`bol`) or is not the start of the row and that is
+ * (`eol`) or is not its end. What was visited is left in `lists[0]`.
+ */
+void regex_follow(struct regex *re, int *seeds, int n_seeds, int bol,
+                  int eol) {
+    struct regex_list *seen = &re->lists[0];
+    seen->n_seen = 0;
+    int top = 0;
+    for (int j = n_seeds - 1; j >= 0; j--) {
+        re->stack[top++] = seeds[j];
+    }
+    while (top) {
+        int pc = re->stack[--top];
+        if (!regex_list_see(seen, pc)) {
+            continue;
+        }
+        struct regex_inst *inst = &re->prog[pc];
+        if (inst->op == RE_JMP) {
+            re->stack[top++] = inst->x;
+        } else if (inst->op == RE_SPLIT) {
+            re->stack[top++] = inst->y;
+            re->stack[top++] = inst->x;
+        } else if ((inst->op == RE_BOL && bol) || (inst->op == RE_EOL && eol)) {
+            re->stack[top++] = pc + 1;
+        }
+    }
+}
+
+uint32_t regex_state_hash(int *pcs, int n_pcs) {
+    uint32_t h = 2166136261u;
+    for (int j = 0; j < n_pcs; j++) {
+        h = (h ^ (uint32_t)pcs[j]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * The DFA state the `seeds` lead to, added if it is new. Returns -1 once the
+ * DFA has taken its share of memory.
+ */
+int regex_closure(struct regex *re, int *seeds, int n_seeds, int bol) {
+    regex_follow(re, seeds, n_seeds, bol, 0);
+    // the instructions that wait for a byte or the end of the row
+    int *pcs = re->lists[1].dense;
+    int n_pcs = 0;
+    for (int j = 0; j < re->lists[0].n_seen; j++) {
+        int pc = re->lists[0].dense[j];
+        int op = re->prog[pc].op;
+        if (op == RE_CLASS || op == RE_MATCH || op == RE_EOL) {
+            pcs[n_pcs++] = pc;
+        }
+    }
+    qsort(pcs, n_pcs, sizeof(int), regex_int_cmp);
+
+    uint32_t h = regex_state_hash(pcs, n_pcs);
+    if (re->table) {
+        for (uint32_t i = h & (re->table_cap - 1); re->table[i];
+             i = (i + 1) & (re->table_cap - 1)) {
+            struct regex_state *s = &re->states[re->table[i] - 1];
+            if (s->n_pcs == n_pcs &&
+                !memcmp(s->pcs, pcs, sizeof(int) * n_pcs)) {
+                return re->table[i] - 1;
+            }
+        }
+    }
+
+    size_t bytes = sizeof(struct regex_state) + sizeof(int) * n_pcs +
+                   sizeof(int) * re->n_byte_classes;
+    if (re->cache_bytes + bytes > REGEX_CACHE_BYTES) {
+        return -1;
+    }
+    re->cache_bytes += bytes;
+    if (re->n_states == re->cap_states) {
+        re->cap_states = re->cap_states ? re->cap_states * 2 : 16;
+        re->states =
+            realloc(re->states, sizeof(struct regex_state) * re->cap_states);
+    }
+    struct regex_state *s = &re->states[re->n_states];
+    s->pcs = malloc(sizeof(int) * (n_pcs + 1));
+    memcpy(s->pcs, pcs, sizeof(int) * n_pcs);
+    s->n_pcs = n_pcs;
+    s->next = malloc(sizeof(int) * re->n_byte_classes);
+    memset(s->next, 0xff, sizeof(int) * re->n_byte_classes);
+    s->match = 0;
+    for (int j = 0; j < n_pcs; j++) {
+        s->match |= re->prog[pcs[j]].op == RE_MATCH;
+    }
+    re->n_states++;
+
+    if (re->n_states * 2 > re->table_cap) {
+        re->table_cap = re->table_cap ? re->table_cap * 2 : 64;
+        re->table = realloc(re->table, sizeof(int) * re->table_cap);
+        memset(re->table, 0, sizeof(int) * re->table_cap);
+        for (int j = 0; j < re->n_states; j++) {
+            struct regex_state *t = &re->states[j];
+            uint32_t i = regex_state_hash(t->pcs, t->n_pcs);
+            for (i &= re->table_cap - 1; re->table[i];
+                 i = (i + 1) & (re->table_cap - 1)) {
+            }
+            re->table[i] = j + 1;
+        }
+    } else {
+        uint32_t i = h & (re->table_cap - 1);
+        while (re->table[i]) {
+            i = (i + 1) & (re->table_cap - 1);
+        }
+        re->table[i] = re->n_states;
+    }
+    return re->n_states - 1;
+}
+
+/**
+ * The state after state `s` reads a byte of class `k`, somewhere past the
+ * start of the row. A match may also start after the byte, so the start of
+ * the program is always among the seeds.
+ */
+int regex_dfa_step(struct regex *re, int s, int k) {
+    int c = re->class_byte[k];
+    int n_seeds = 0;
+    for (int j = 0; j < re->states[s].n_pcs; j++) {
+        int pc = re->states[s].pcs[j];
+        if (re->prog[pc].op == RE_CLASS &&
+            regex_class_has(re->classes[re->prog[pc].x], c)) {
+            re->seeds[n_seeds++] = pc + 1;
+        }
+    }
+    re->seeds[n_seeds++] = 0;
+    int next = regex_closure(re, re->seeds, n_seeds, 0);
+    if (next != -1) {
+        re->states[s].next[k] = next;
+    }
+    return next;
+}
+
+/**
+ * Whether state `s` matches at the end of the row
+ */
+int regex_dfa_accepts(struct regex *re, int s, int bol) {
+    int n_seeds = 0;
+    for (int j = 0; j < re->states[s].n_pcs; j++) {
+        int pc = re->states[s].pcs[j];
+        if (re->prog[pc].op == RE_EOL) {
+            re->seeds[n_seeds++] = pc + 1;
+        }
+    }
+    regex_follow(re, re->seeds, n_seeds, bol, 1);
+    for (int j = 0; j < re->lists[0].n_seen; j++) {
+        if (re->prog[re->lists[0].dense[j]].op == RE_MATCH) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Whether `hay[0, len)` contains a match, or -1 if the DFA ran out of memory
+ * on the way
+ */
+int regex_dfa_matches(struct regex *re, const char *hay, int len) {
+    if (re->start == -1) {
+        int seed = 0;
+        re->start_bol = regex_closure(re, &seed, 1, 1);
+        re->start = regex_closure(re, &seed, 1, 0);
+        if (re->start_bol == -1 || re->start == -1) {
+            return -1;
+        }
+    }
+    int s = re->start_bol;
+    for (int pos = 0; pos < len; pos++) {
+        if (re->states[s].match) {
+            return 1;
+        }
+        if (re->states[s].n_pcs == 0) {
+            return 0;
+        }
+        if (s == re->start && re->prefix.len) {
+            // no match in progress: skip to where the next one can start
+            int found = search_first(hay + pos, len - pos, &re->prefix);
+            if (found == -1) {
+                return 0;
+            }
+            pos += found;
+        }
+        int k = re->byte_class[(unsigned char)hay[pos]];
+        int next = re->states[s].next[k];
+        if (next == -1 && (next = regex_dfa_step(re, s, k)) == -1) {
+            return -1;
+        }
+        s = next;
+    }
+    return re->states[s].match || regex_dfa_accepts(re, s, len == 0);
+}
+
+/**
+ * Whether `hay[0, len)` contains a match
+ */
+int regex_matches(struct regex *re, const char *hay, int len) {
+    if (!re->word_boundary) {
+        int found = regex_dfa_matches(re, hay, len);
+        if (found != -1) {
+            return found;
+        }
+        // start the DFA over on the next row; this one takes the slow way
+        regex_cache_clear(re);
+    }
+    int end;
+    return regex_find(re, hay, len, 0, &end) != -1;
+}
+
+/**
+ * Prepare `pattern` as a regular expression. The literal fields of the
+ * needle hold the prefix every match starts with, for the trigram index.
+ * On a bad pattern returns -1 and sets `*error`; the needle then matches
+ * nothing.
+ */
+int search_needle_init_regex(struct search_needle *n, const char *pattern,
+                             int ignore_case, const char **error) {
+    struct regex *re = regex_compile(pattern, ignore_case, error);
+    search_needle_init(n, re ? re->prefix.s : "", ignore_case);
+    n->re = re;
+    return re ? 0 : -1;
+}
+
+/**
+ * Whether `n` matches nothing at all
+ */
+int search_needle_empty(const struct search_needle *n) {
+    return n->re == NULL && n->len == 0;
+}
+
+/**
+ * Offset of the first match of `n` starting at or after `from` in
+ * `hay[0, len)`, or -1; the offset where the match ends goes to `*end`
+ */
+int search_match(const char *hay, int len, int from,
+                 const struct search_needle *n, int *end) {
+    if (n->re) {
+        return regex_find(n->re, hay, len, from, end);
+    }
+    int found = search_first(hay + from, len - from, n);
+    if (found == -1) {
+        return -1;
+    }
+    *end = from + found + n->len;
+    return from + found;
+}
+
+/**
+ * Whether `n` matches anywhere in `hay[0, len)`
+ */
+int search_any(const char *hay, int len, const struct search_needle *n) {
+    if (n->re) {
+        return regex_matches(n->re, hay, len);
+    }
+    return search_first(hay, len, n) != -1;
+}
+
+/*** event loop ***/
+
+/**
+ * What the editor waits on besides keys: workers finishing, timers, signals,
+ * and file descriptors other parts of the editor watch. On Linux, timers and
+ * signals arrive through a timerfd and a signalfd; elsewhere through the
+ * timeout of poll() and a pipe written to by a signal handler.
+ */
+struct event_watch {
+    int fd;
+    short events;
+    void (*handler)(int fd, short revents, void *arg);
+    void *arg;
+};
+
+struct event_loop {
+    int wake[2];  // a worker writes a byte to `wake[1]` once it is done
+    int signal_fd;
+    int signal_pipe;    // the handler's end of the pipe, without signalfd
+    int timer_fd;       // -1 without timerfd
+    uint64_t timer_at;  // what the timer is set for, 0 if not set
+    struct event_watch *watches;
+    int n_watches;
+    int cap_watches;
+};
+
+struct event_loop L = {{-1, -1}, -1, -1, -1, 0, NULL, 0, 0};
+
+// the signals handled in the loop rather than where they strike
+int event_signals[] = {SIGHUP, SIGTERM, SIGWINCH};
+
+void event_loop_on_signal(int sig) {
+    unsigned char byte = sig;
+    ssize_t n = write(L.signal_pipe, &byte, 1);
+    (void)n;  // a full pipe already has the loop woken
+}
+
+void event_set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Set up the loop; called before any thread is started, so that they all
+ * inherit the signal mask
+ */
+void event_loop_init() {
+    if (pipe(L.wake) == -1) {
+        die("pipe");
+    }
+    // neither a worker nor the loop is ever held up on the pipe
+    event_set_nonblock(L.wake[0]);
+    event_set_nonblock(L.wake[1]);
+
+    sigset_t set;
+    sigemptyset(&set);
+    for (size_t j = 0; j < sizeof(event_signals) / sizeof(int); j++) {
+        sigaddset(&set, event_signals[j]);
+    }
+#ifdef __linux__
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    L.signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (L.signal_fd == -1) {
+        die("signalfd");
+    }
+    L.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (L.timer_fd == -1) {
+        die("timerfd_create");
+    }
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        die("pipe");
+    }
+    event_set_nonblock(fds[0]);
+    event_set_nonblock(fds[1]);
+    L.signal_fd = fds[0];
+    L.signal_pipe = fds[1];
+    struct sigaction sa = {0};
+    sa.sa_handler = event_loop_on_signal;
+    sa.sa_flags = SA_RESTART;
+    for (size_t j = 0; j < sizeof(event_signals) / sizeof(int); j++) {
+        sigaction(event_signals[j], &sa, NULL);
+    }
+#endif
+}
+
+/**
+ * Wake the loop from a worker thread, e.g. once a result is ready
+ */
+void event_loop_wake() {
+    if (L.wake[1] == -1) {
+        return;  // no loop to wake, as when benchmarking
+    }
+    char byte = 0;
+    ssize_t n = write(L.wake[1], &byte, 1);
+    (void)n;  // a full pipe already has the loop woken
+}
+
+/**
+ * The next signal that came in, 0 if none did
+ */
+int event_loop_next_signal() {
+#ifdef __linux__
+    struct signalfd_siginfo info;
+    if (read(L.signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return 0;
+    }
+    return info.ssi_signo;
+#else
+    unsigned char sig;
+    if (read(L.signal_fd, &sig, 1) != 1) {
+        return 0;
+    }
+    return sig;
+#endif
+}
+
+/**
+ * Call `handler(fd, revents, arg)` whenever `fd` is ready for `events` while
+ * waiting for a key
+ */
+void editor_watch_fd(int fd, short events,
+                     void (*handler)(int fd, short revents, void *arg),
+                     void *arg) {
+    if (L.n_watches == L.cap_watches) {
+        L.cap_watches = L.cap_watches ? L.cap_watches * 2 : 4;
+        L.watches =
+            realloc(L.watches, sizeof(struct event_watch) * L.cap_watches);
+    }
+    L.watches[L.n_watches++] = (struct event_watch){fd, events, handler, arg};
+}
+
+void editor_unwatch_fd(int fd) {
+    for (int j = 0; j < L.n_watches; j++) {
+        if (L.watches[j].fd == fd) {
+            L.watches[j] = L.watches[--L.n_watches];
+            return;
+        }
+    }
+}
+
+/**
+ * When, on the `now_ns()` clock, something next happens by itself, 0 if
+ * nothing will: the status message goes away, or matches are counted again
+ */
+uint64_t editor_next_timer() {
+    uint64_t at = editor_find_count_due();
+    time_t expiry = E.status_msg_time + KILO_MESSAGE_SECONDS;
+    if (E.status_msg[0] && time(NULL) < expiry) {
+        // how far off that is, by a finer clock than time()'s; that one can
+        // run a tick behind, so check back shortly until it catches up
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t real = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        uint64_t expiry_ns = (uint64_t)expiry * 1000000000;
+        uint64_t message_at =
+            now_ns() + (real < expiry_ns ? expiry_ns - real : 1000000);
+        if (at == 0 || message_at < at) {
+            at = message_at;
+        }
+    }
+    return at;
+}
+
+/**
+ * Set the timer for `at`, or clear it for 0. Returns how long poll() may
+ * sleep in milliseconds, -1 for as long as it takes.
+ */
+int event_loop_set_timer(uint64_t at) {
+#ifdef __linux__
+    if (at != L.timer_at) {
+        struct itimerspec spec = {{0, 0},
+                                  {at / 1000000000, at % 1000000000}};
+        timerfd_settime(L.timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+        L.timer_at = at;
+    }
+    return -1;
+#else
+    if (at == 0) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    // rounded up, so as not to wake before it is time
+    return at > now ? (at - now + 999999) / 1000000 : 0;
+#endif
+}
+
+/**
+ * Take on the terminal's new size after it was resized
+ */
+void editor_handle_resize() {
+    // only asked of the kernel: the fallback of moving the cursor to the
+    // corner and asking the terminal where it ended up is a round trip
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return;
+    }
+    E.screen_rows = ws.ws_row > 3 ? ws.ws_row - 2 : 1;
+    E.screen_cols = ws.ws_col;
+    // the frames follow on the next refresh, which draws the screen afresh
+    editor_refresh_screen();
+}
+
+void editor_handle_signal(int sig) {
+    if (sig == SIGHUP || sig == SIGTERM) {
+        // leave the screen as on Ctrl-Q; the terminal's modes are restored
+        // on exit
+        if (write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7) == -1) {
+            exit(1);
+        }
+        exit(128 + sig);
+    }
+}
+
+/**
+ * Handle events until a key is waiting. Work the main thread has pending,
+ * searching and highlighting, is done a slice at a time in between; without
+ * any, this sleeps in poll() until something happens.
+ */
+void editor_wait_for_key() {
+    while (E.input.start == E.input.end) {
+        // what opening a file left for after its first screen, results of
+        // workers, and searches to count again after an edit
+        if (editor_open_finish() | editor_find_count_poll() |
+            editor_index_poll() | editor_save_poll()) {
+            editor_refresh_screen();
+        }
+        int busy = editor_find_pending() || editor_hl_pending();
+        uint64_t at = editor_next_timer();
+        int timeout = event_loop_set_timer(at);
+
+        int n_fds = 4 + L.n_watches;
+        struct pollfd fds[n_fds];
+        fds[0] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+        fds[1] = (struct pollfd){L.wake[0], POLLIN, 0};
+        fds[2] = (struct pollfd){L.signal_fd, POLLIN, 0};
+        fds[3] = (struct pollfd){L.timer_fd, POLLIN, 0};  // -1 is skipped
+        for (int j = 0; j < L.n_watches; j++) {
+            fds[4 + j] =
+                (struct pollfd){L.watches[j].fd, L.watches[j].events, 0};
+        }
+        int ready = poll(fds, n_fds, busy ? 0 : timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+
+        if (fds[1].revents) {
+            char drain[64];
+            while (read(L.wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        if (fds[2].revents) {
+            int sig, resized = 0;
+            while ((sig = event_loop_next_signal()) != 0) {
+                if (sig == SIGWINCH) {
+                    resized = 1;  // a burst of them is taken in one go
+                } else {
+                    editor_handle_signal(sig);
+                }
+            }
+            if (resized) {
+                editor_handle_resize();
+            }
+        }
+        if (fds[3].revents) {
+            uint64_t expirations;
+            if (read(L.timer_fd, &expirations, sizeof(expirations)) > 0) {
+                L.timer_at = 0;
+            }
+        }
+        if (at && now_ns() >= at) {
+            // the count starts over at the top of the loop
+            editor_refresh_screen();
+        }
+        for (int j = 4; j < n_fds; j++) {
+            // looked up again, as a handler may have unwatched others
+            for (int k = 0; fds[j].revents && k < L.n_watches; k++) {
+                if (L.watches[k].fd == fds[j].fd) {
+                    L.watches[k].handler(fds[j].fd, fds[j].revents,
+                                         L.watches[k].arg);
+                    break;
+                }
+            }
+        }
+        if (fds[0].revents) {
+            return;
+        }
+        if (busy && ready == 0) {
+            if (editor_find_pending()) {
+                editor_find_step();
+            } else {
+                editor_hl_step();
+            }
+        }
+    }
+}
+
+/*** terminal ***/
+
+/**
+ * Turn off raw mode
+ */
+void disable_raw_mode() {
+    // stop bracketing pastes; if that fails there is nothing better to do,
+    // and the terminal settings must be put back regardless
+    int ignored = write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    (void)ignored;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
+        die("tcsetattr");
+    }
+}
+
+/**
+ * Turn off the ECHO feature of the terminal
+ */
+void enable_raw_mode() {
+    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
+        // invalid ioctl
+        die("tcgetattr");
+    }
+    atexit(disable_raw_mode);
+
+    struct termios raw = E.orig_termios;
+    raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    // c_lflag - local modes
+    // ECHO - a bitflag
+    //   - 00000000000000000000000000001000 in binary
+    raw.c_lflag &=
+        ~(ECHO | ICANON | ISIG | IEXTEN);  // turn off ECHO _and_ Canonical mode
+
+    // `cc` - control characters, array of bytes that control terminal settings
+    // read() returns at once, with or without input: waiting is done in
+    // poll()
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    // TCSAFLUSH - how/when the changes take effect
+    //  - waits for all pending output to be written to terminal
+    //  - discards any input not read yet
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        die("tcsetattr");
+    }
+    // have the terminal bracket pasted text with `Esc [ 200 ~` and
+    // `Esc [ 201 ~`, so that it can be told apart from typing
+    if (write(STDOUT_FILENO, "\x1b[?2004h", 8) != 8) {
+        die("write");
+    }
+}
+
+/**
+ * Read as much of the waiting input as fits into `E.input`, waiting up to 1/10
+ * of a second for some if there is none. Returns how many bytes came.
+ */
+int input_fill() {
+    struct input_buffer *in = &E.input;
+    if (in->start == in->end) {
+        in->start = in->end = 0;
+    } else if (in->end == (int)sizeof(in->buf)) {
+        memmove(in->buf, &in->buf[in->start], in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) {
+        return 0;
+    }
+    int n = read(STDIN_FILENO, &in->buf[in->end], sizeof(in->buf) - in->end);
+    // read() returns -1 on failure
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        die("read");
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    in->end += n;
+    return n;
+}
+
+/**
+ * Take the next byte of input into `c`, reading more if none is buffered.
+ * Returns 0 if none came within 1/10 of a second.
+ */
+int input_getc(char *c) {
+    if (E.input.start == E.input.end && input_fill() == 0) {
+        return 0;
+    }
+    *c = E.input.buf[E.input.start++];
+    return 1;
+}
+
+/**
+ * Wait for the terminal's reply to a query: a control sequence
+ * `Esc [ ... f` whose final byte `f` is one of `finals`. The reply is taken
+ * out of `E.input` into `reply`, and whatever else is there, such as keys
+ * typed meanwhile, is left for the editor. Gives up once no input has come
+ * for a second. Returns the final byte, or 0 if no reply came.
+ */
+int input_take_reply(const char *finals, char *reply, int size) {
+    struct input_buffer *in = &E.input;
+    int scanned = 0;  // bytes from `in->start` that are not part of a reply
+    int waits = 0;
+    while (waits < 10) {
+        int i = in->start + scanned;
+        while (i < in->end) {
+            if (in->buf[i] != '\x1b') {
+                i++;
+                continue;
+            }
+            if (i + 1 == in->end) {
+                break;  // more may follow
+            }
+            if (in->buf[i + 1] != '[') {
+                i++;
+                continue;
+            }
+            // parameters and intermediates, then the final byte
+            int j = i + 2;
+            while (j < in->end && in->buf[j] >= 0x20 && in->buf[j] <= 0x3f) {
+                j++;
+            }
+            if (j == in->end) {
+                break;
+            }
+            char final = in->buf[j];
+            if (!strchr(finals, final)) {
+                i = j + 1;  // a key, as an arrow key is
+                continue;
+            }
+            int len = j + 1 - i < size - 1 ? j + 1 - i : size - 1;
+            memcpy(reply, &in->buf[i], len);
+            reply[len] = '\0';
+            memmove(&in->buf[i], &in->buf[j + 1], in->end - j - 1);
+            in->end -= j + 1 - i;
+            return final;
+        }
+        // `input_fill()` may move the buffered input to the front
+        scanned = i - in->start;
+        if (input_fill() == 0) {
+            waits++;
+        } else {
+            waits = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Whether a keypress is waiting to be read
+ */
+int editor_input_pending() {
+    if (E.input.start < E.input.end) {
+        return 1;
+    }
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * Wait for one keypress, then return it
+ */
+int editor_read_key() {
+    // the time until the next keypress goes to searching and background
+    // highlighting
+    char c;
+    do {
+        editor_wait_for_key();
+    } while (!input_getc(&c));
+
+    // Map arrow keys to j/h/k/l
+    // arrow key presses are interpreted as an escape sequence
+    // `'\x1b'`, `[`, followed by
+    //   - `'A'`
+    //   - `'B'`
+    //   - `'C'`
+    //   - `'D'`
+    if (c == '\x1b') {
+        char seq[2];
+
+        if (!input_getc(&seq[0])) return '\x1b';
+        if (!input_getc(&seq[1])) return '\x1b';
+
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                // the code may have more digits, as 200 for a paste does
+                int code = 0;
+                do {
+                    code = code * 10 + seq[1] - '0';
+                    if (!input_getc(&seq[1])) {
+                        return '\x1b';
+                    }
+                } while (seq[1] >= '0' && seq[1] <= '9');
+                if (seq[1] == '~') {
+                    switch (code) {
+                        case 1:
+                            return HOME_KEY;
+                        case 3:
+                            return DEL_KEY;
+                        case 4:
+                            return END_KEY;
+                        case 5:
+                            return PAGE_UP;
+                        case 6:
+                            return PAGE_DOWN;
+                        case 7:
+                            return HOME_KEY;
+                        case 8:
+                            return END_KEY;
+                        case 200:
+                            return PASTE_START;
+                        case 201:
+                            return PASTE_END;
+                    }
+                }
+            } else {
+                switch (seq[1]) {
+                    case 'A':
+                        return ARROW_UP;
+                    case 'B':
+                        return ARROW_DOWN;
+                    case 'C':
+                        return ARROW_RIGHT;
+                    case 'D':
+                        return ARROW_LEFT;
+                    case 'H':
+                        return HOME_KEY;
+                    case 'F':
+                        return END_KEY;
+                }
+            }
+        } else if (seq[0] == 'O') {
+            switch (seq[1]) {
+                case 'H':
+                    return HOME_KEY;
+                case 'F':
+                    return END_KEY;
+            }
+        }
+
+        return '\x1b';
+    } else {
+        return c;
+    }
+}
+
+/**
+ * Read the text of a paste, after its PASTE_START, up to the `Esc [ 201 ~`
+ * ending it, or until input stops coming for a second. Line breaks, which
+ * terminals send as carriage returns, come back as newlines.
+ */
+char *editor_read_paste(size_t *len) {
+    size_t cap = KILO_INPUT_BYTES;
+    char *buf = malloc(cap);
+    size_t n = 0;
+    int waits = 0;
+    char c, prev = 0;
+    while (waits < 10) {
+        if (!input_getc(&c)) {
+            waits++;
+            continue;
+        }
+        waits = 0;
+        if (c == '\n' && prev == '\r') {
+            prev = c;
+            continue;  // the CR before it was the line break
+        }
+        prev = c;
+        if (n == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        buf[n++] = c == '\r' ? '\n' : c;
+        if (n >= 6 && !memcmp(&buf[n - 6], "\x1b[201~", 6)) {
+            n -= 6;
+            break;
+        }
+    }
+    *len = n;
+    return buf;
+}
+
+int get_cursor_position(int *rows, int *cols) {
+    // the `n` command - query terminal for status info
+    // response should be CPR (cursor position report)
+    //   - `Esc [ Pn;Pn R`
+
+    char buf[32];
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+
+    if (!input_take_reply("R", buf, sizeof(buf))) {
+        return -1;
+    }
+    // skipping '\x1b' and '['
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
+        // parse two integers separated by ';'
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Ask the terminal whether it supports synchronized output (DEC private mode
+ * 2026) with DECRQM. Every terminal answers the DA1 query sent after it, so
+ * its reply ends the wait whether or not the first query was understood.
+ */
+int get_sync_output_support() {
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12) != 12) return 0;
+
+    // a terminal that does not know the mode only answers the DA1 query,
+    // which every terminal does, and does last
+    char buf[128];
+    int supported = 0, final;
+    while ((final = input_take_reply("yc", buf, sizeof(buf))) == 'y') {
+        // `Esc [ ? 2026 ; Ps $ y`, where Ps is 1 or 2 for a mode that is set
+        // or reset, and 3 for one that is always set
+        int mode;
+        if (sscanf(buf, "\x1b[?2026;%d$y", &mode) == 1 && mode >= 1 &&
+            mode <= 3) {
+            supported = 1;
+        }
+    }
+    return supported;
+}
+
+int get_window_size(int *rows, int *cols) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        // 1. move cursor to bottom right corner
+        // 2. get cursor position
+        // the `C` command - moves cursor to the right
+        // the `B` command - moves cursor down
+        // do _NOT_ use the `H` command like `999;999H` because it does not
+        // specify what happens if moving pass screen edge
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+            return -1;
+        }
+        return get_cursor_position(rows, cols);
+    } else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+/*** keyword trie ***/
+
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/**
+ * Whether any of the first `len` bytes of `s` is a separator
+ */
+int has_separator(const char *s, int len) {
+    for (int j = 0; j < len; j++) {
+        if (is_separator(s[j])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The `reserveds` of a syntax compiled into a trie, stored as a transition
+ * table. Bytes that appear in no keyword all share column 0, which has no
+ * transitions.
+ */
+struct keyword_trie {
+    unsigned char byte_class[256];  // byte -> column in `next`
+    int n_classes;
+    int n_nodes;
+    int *next;             // n_nodes rows of n_classes; 0 = no such keyword
+    unsigned char *kind;   // per node: HL_NORMAL, or the keyword ending there
+    unsigned char *depth;  // per node: length of the word leading to it
+};
+
+struct keyword_trie *keyword_trie_compile(char **reserveds) {
+    struct keyword_trie *t = calloc(1, sizeof(struct keyword_trie));
+    t->n_classes = 1;
+    int max_nodes = 1;
+    for (int j = 0; reserveds && reserveds[j]; j++) {
+        for (char *p = reserveds[j]; *p; p++) {
+            unsigned char b = *p;
+            if (!t->byte_class[b]) {
+                t->byte_class[b] = t->n_classes++;
+            }
+            max_nodes++;
+        }
+    }
+    t->next = calloc(max_nodes * t->n_classes, sizeof(int));
+    t->kind = calloc(max_nodes, 1);
+    t->depth = calloc(max_nodes, 1);
+    t->n_nodes = 1;  // the root
+
+    for (int j = 0; reserveds && reserveds[j]; j++) {
+        int len = strlen(reserveds[j]);
+        // a trailing '|' marks a type rather than a keyword
+        int reserved_type = reserveds[j][len - 1] == '|';
+        if (reserved_type) len--;
+        if (len == 0 || len > 255) continue;
+        // words end at separators, so the lexer cannot match one spanning a
+        // separator; the syntax loader turns those away
+        if (has_separator(reserveds[j], len)) continue;
+
+        int node = 0;
+        for (int k = 0; k < len; k++) {
+            int *edge = &t->next[node * t->n_classes +
+                                 t->byte_class[(unsigned char)reserveds[j][k]]];
+            if (*edge == 0) {
+                *edge = t->n_nodes++;
+                t->depth[*edge] = k + 1;
+            }
+            node = *edge;
+        }
+        if (t->kind[node] == HL_NORMAL) {
+            // the first entry wins, as it did with a linear search
+            t->kind[node] =
+                reserved_type ? HL_RESERVED_TYPE : HL_RESERVED_KEYWORD;
+        }
+    }
+    return t;
+}
+
+/**
+ * The node reached from `node` on byte `b`, or 0 if no keyword continues so
+ */
+int keyword_trie_step(struct keyword_trie *t, int node, unsigned char b) {
+    return t->next[node * t->n_classes + t->byte_class[b]];
+}
+
+void keyword_trie_free(struct keyword_trie *t) {
+    free(t->next);
+    free(t->kind);
+    free(t->depth);
+    free(t);
+}
+
+/*** lexer ***/
+
+/**
+ * A syntax compiled into a DFA over byte classes. Highlighting a row is one
+ * table lookup per byte with no lookahead: multi-byte delimiters and
+ * keywords are recognized at their last byte (or at the separator after a
+ * keyword), and the transition then paints the bytes that led up to it.
+ */
+struct lexer_edge {
+    int next;
+    unsigned char hl;       // highlight of the byte consumed
+    unsigned char back_hl;  // highlight painted over the `back` bytes before it
+    unsigned short back;
+};
+
+struct lexer {
+    unsigned char byte_class[256];
+    int n_classes;
+    int n_states;
+    struct lexer_edge *edges;  // n_states rows of n_classes
+    // per state: the keyword a row ending here finishes, if any
+    unsigned short *eol_back;
+    unsigned char *eol_hl;
+    unsigned char *in_comment;  // per state: inside a multiline comment
+    int start;          // state a row starts in
+    int start_comment;  // ... when it starts inside a multiline comment
+    int line_comment;   // state that swallows the rest of the row, or -1
+    uint64_t compile_ns;
+};
+
+enum LEXER_MODE {
+    LEX_NORMAL = 0,
+    LEX_ML_COMMENT,
+    LEX_STRING,
+    LEX_STRING_ESC,
+    LEX_LINE_COMMENT,
+};
+
+/**
+ * A state while compiling: the mode we are in plus whatever the original
+ * character-by-character rules remember between bytes
+ */
+struct lex_state {
+    int mode;
+    int ac;        // LEX_NORMAL: delimiter automaton state
+    int prev_sep;  // LEX_NORMAL: previous byte was a separator
+    int prev_num;  // LEX_NORMAL: previous byte was part of a number
+    int kw;        // LEX_NORMAL: keyword trie node of the current word, or -1
+    int kmp;       // LEX_ML_COMMENT: bytes of the comment end matched so far
+    int quote;     // LEX_STRING(_ESC): the closing quote
+};
+
+// delimiters that leave LEX_NORMAL, in the order they take precedence
+#define LEX_MAX_OPENERS 4
+#define LEX_MAX_AC 64
+// the comment openers share the automaton with the two quotes and its root
+#define LEX_MAX_COMMENT_OPENERS (LEX_MAX_AC - 3)
+// longest multiline comment end: `kmp` gets 8 bits of a state's key
+#define LEX_MAX_COMMENT_END 255
+
+struct lexer_builder {
+    struct editor_syntax *syntax;
+    struct keyword_trie *keywords;
+    char *openers[LEX_MAX_OPENERS];
+    int opener_mode[LEX_MAX_OPENERS];
+    int n_openers;
+    // Aho-Corasick automaton over the openers
+    int ac_next[LEX_MAX_AC][256];
+    int ac_out[LEX_MAX_AC];  // opener completed on entering a state, or -1
+    int n_ac;
+    // KMP automaton over the multiline comment end
+    int (*kmp_next)[256];
+    int mce_len;
+    // interned states
+    struct lex_state *states;
+    int n_states;
+    int cap_states;
+    uint64_t *keys;
+    int *ids;
+    int hash_cap;
+};
+
+void lexer_add_opener(struct lexer_builder *b, char *s, int mode) {
+    int len = s ? strlen(s) : 0;
+    if (len == 0 || b->n_openers == LEX_MAX_OPENERS) return;
+    b->openers[b->n_openers] = s;
+    b->opener_mode[b->n_openers] = mode;
+    b->n_openers++;
+}
+
+void lexer_build_ac(struct lexer_builder *b) {
+    int fail[LEX_MAX_AC];
+    memset(b->ac_next, -1, sizeof(b->ac_next));
+    b->n_ac = 1;
+    b->ac_out[0] = -1;
+    for (int p = 0; p < b->n_openers; p++) {
+        int node = 0;
+        for (char *s = b->openers[p]; *s; s++) {
+            int *edge = &b->ac_next[node][(unsigned char)*s];
+            if (*edge == -1) {
+                // the syntax loader keeps the openers short enough
+                if (b->n_ac == LEX_MAX_AC) return;
+                *edge = b->n_ac;
+                b->ac_out[b->n_ac++] = -1;
+            }
+            node = *edge;
+        }
+        if (b->ac_out[node] == -1) {
+            b->ac_out[node] = p;
+        }
+    }
+
+    // breadth first, so failure links point at finished states
+    int queue[LEX_MAX_AC];
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int child = b->ac_next[0][c];
+        if (child == -1) {
+            b->ac_next[0][c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int node = queue[head++];
+        // an opener ending at a suffix of this state also completes here;
+        // the one listed first wins
+        int out = b->ac_out[fail[node]];
+        if (out != -1 && (b->ac_out[node] == -1 || out < b->ac_out[node])) {
+            b->ac_out[node] = out;
+        }
+        for (int c = 0; c < 256; c++) {
+            int child = b->ac_next[node][c];
+            if (child == -1) {
+                b->ac_next[node][c] = b->ac_next[fail[node]][c];
+            } else {
+                fail[child] = b->ac_next[fail[node]][c];
+                queue[tail++] = child;
+            }
+        }
+    }
+}
+
+void lexer_build_kmp(struct lexer_builder *b) {
+    char *mce = b->syntax->multiline_comment_end;
+    b->mce_len = strlen(mce);
+    b->kmp_next = calloc(b->mce_len, sizeof(*b->kmp_next));
+    b->kmp_next[0][(unsigned char)mce[0]] = 1;
+    int x = 0;
+    for (int j = 1; j < b->mce_len; j++) {
+        memcpy(b->kmp_next[j], b->kmp_next[x], sizeof(b->kmp_next[j]));
+        b->kmp_next[j][(unsigned char)mce[j]] = j + 1;
+        x = b->kmp_next[x][(unsigned char)mce[j]];
+    }
+}
+
+uint64_t lex_state_key(struct lex_state *s) {
+    return (uint64_t)s->mode | (uint64_t)s->ac << 3 |
+           (uint64_t)s->prev_sep << 9 | (uint64_t)s->prev_num << 10 |
+           (uint64_t)(s->kmp & 0xff) << 11 | (uint64_t)s->quote << 19 |
+           (uint64_t)(s->kw + 1) << 27;
+}
+
+/**
+ * The id of state `s`, adding it if it is new
+ */
+int lexer_intern(struct lexer_builder *b, struct lex_state *s) {
+    if (b->n_states * 2 >= b->hash_cap) {
+        int cap = b->hash_cap ? b->hash_cap * 2 : 1024;
+        uint64_t *keys = malloc(sizeof(uint64_t) * cap);
+        int *ids = malloc(sizeof(int) * cap);
+        memset(ids, -1, sizeof(int) * cap);
+        for (int j = 0; j < b->hash_cap; j++) {
+            if (b->ids[j] == -1) continue;
+            int h = (b->keys[j] * 0x9e3779b97f4a7c15ULL) >> 40 & (cap - 1);
+            while (ids[h] != -1) h = (h + 1) & (cap - 1);
+            keys[h] = b->keys[j];
+            ids[h] = b->ids[j];
+        }
+        free(b->keys);
+        free(b->ids);
+        b->keys = keys;
+        b->ids = ids;
+        b->hash_cap = cap;
+    }
+
+    uint64_t key = lex_state_key(s);
+    int h = (key * 0x9e3779b97f4a7c15ULL) >> 40 & (b->hash_cap - 1);
+    while (b->ids[h] != -1) {
+        if (b->keys[h] == key) return b->ids[h];
+        h = (h + 1) & (b->hash_cap - 1);
+    }
+    if (b->n_states == b->cap_states) {
+        b->cap_states = b->cap_states ? b->cap_states * 2 : 256;
+        b->states =
+            realloc(b->states, sizeof(struct lex_state) * b->cap_states);
+    }
+    b->keys[h] = key;
+    b->ids[h] = b->n_states;
+    b->states[b->n_states] = *s;
+    return b->n_states++;
+}
+
+/**
+ * What the highlighting rules do on byte `c` in state `s`: fills in the
+ * highlight and back-painting of `e` and returns the state that follows
+ */
+struct lex_state lexer_step(struct lexer_builder *b, struct lex_state *s,
+                            unsigned char c, struct lexer_edge *e) {
+    struct lex_state normal = {LEX_NORMAL, 0, 1, 0, -1, 0, 0};
+    struct lex_state next = *s;
+    int flags = b->syntax->flags;
+    e->back = 0;
+    e->back_hl = HL_NORMAL;
+
+    switch (s->mode) {
+        case LEX_LINE_COMMENT:
+            e->hl = HL_COMMENT;
+            return next;
+        case LEX_ML_COMMENT:
+            e->hl = HL_ML_COMMENT;
+            next.kmp = b->kmp_next[s->kmp][c];
+            // the closing quote or comment end counts as a separator
+            return next.kmp == b->mce_len ? normal : next;
+        case LEX_STRING:
+            e->hl = HL_STRING;
+            if (c == '\\') {
+                next.mode = LEX_STRING_ESC;  // when `\'` or `\"`
+            } else if (c == s->quote) {
+                return normal;
+            }
+            return next;
+        case LEX_STRING_ESC:
+            e->hl = HL_STRING;
+            next.mode = LEX_STRING;
+            return next;
+    }
+
+    next.ac = b->ac_next[s->ac][c];
+    int opener = b->ac_out[next.ac];
+    int kind = s->kw >= 0 ? b->keywords->kind[s->kw] : HL_NORMAL;
+    int sep = is_separator(c);
+    if (opener != -1) {
+        int len = strlen(b->openers[opener]);
+        int mode = b->opener_mode[opener];
+        e->hl = mode == LEX_LINE_COMMENT ? HL_COMMENT
+                : mode == LEX_ML_COMMENT ? HL_ML_COMMENT
+                                         : HL_STRING;
+        e->back = len - 1;
+        e->back_hl = e->hl;
+        if (len == 1 && sep && kind != HL_NORMAL) {
+            // a one-byte separator delimiter also ends the keyword before it
+            e->back = b->keywords->depth[s->kw];
+            e->back_hl = kind;
+        }
+        struct lex_state entered = {mode, 0, 0, 0, -1, 0, 0};
+        if (mode == LEX_STRING) {
+            entered.quote = c;  // store closing/opening quote
+        }
+        return entered;
+    }
+
+    e->hl = HL_NORMAL;
+    next.prev_num = 0;
+    if ((flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit(c) && (s->prev_sep || s->prev_num)) ||
+         (c == '.' && s->prev_num))) {
+        e->hl = HL_NUMBER;
+        next.prev_sep = 0;  // in the middle of highlighting something
+        next.prev_num = 1;
+        next.kw = -1;
+    } else if (s->prev_sep) {
+        // keywords require a separator both _before_ and _after_
+        next.prev_sep = sep;
+        next.kw = sep ? -1 : keyword_trie_step(b->keywords, 0, c);
+        if (next.kw == 0) next.kw = -1;
+    } else if (s->kw >= 0 && sep) {
+        // the word before this separator is complete
+        if (kind != HL_NORMAL) {
+            e->back = b->keywords->depth[s->kw];
+            e->back_hl = kind;
+        }
+        next.prev_sep = 1;
+        next.kw = -1;
+    } else if (s->kw >= 0) {
+        next.kw = keyword_trie_step(b->keywords, s->kw, c);
+        if (next.kw == 0) next.kw = -1;
+    } else {
+        next.prev_sep = sep;
+    }
+    return next;
+}
+
+/**
+ * Compile the highlighting rules of a syntax into a `struct lexer`
+ */
+struct lexer *lexer_compile(struct editor_syntax *syntax) {
+    uint64_t start = now_ns();
+    struct lexer_builder *b = calloc(1, sizeof(struct lexer_builder));
+    b->syntax = syntax;
+    b->keywords = keyword_trie_compile(syntax->reserveds);
+
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+    int has_ml = mcs && *mcs && mce && *mce;
+    lexer_add_opener(b, syntax->singleline_comment_start, LEX_LINE_COMMENT);
+    if (has_ml) {
+        lexer_add_opener(b, mcs, LEX_ML_COMMENT);
+        lexer_build_kmp(b);
+    }
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        lexer_add_opener(b, "\"", LEX_STRING);
+        lexer_add_opener(b, "'", LEX_STRING);
+    }
+    lexer_build_ac(b);
+
+    // bytes that every automaton treats alike share a class
+    struct lexer *lex = calloc(1, sizeof(struct lexer));
+    int signature[256][4];
+    int representative[256];
+    for (int c = 0; c < 256; c++) {
+        int in_delimiter = 0;
+        for (int p = 0; p < b->n_openers; p++) {
+            in_delimiter |= strchr(b->openers[p], c) != NULL;
+        }
+        if (has_ml) in_delimiter |= strchr(mce, c) != NULL;
+        int sig[4] = {
+            (in_delimiter || c == '\\' || c == '.') ? c : -1,
+            b->keywords->byte_class[c],
+            is_separator(c),
+            isdigit(c) != 0,
+        };
+        int cls;
+        for (cls = 0; cls < lex->n_classes; cls++) {
+            if (!memcmp(signature[cls], sig, sizeof(sig))) break;
+        }
+        if (cls == lex->n_classes) {
+            memcpy(signature[cls], sig, sizeof(sig));
+            representative[cls] = c;
+            lex->n_classes++;
+        }
+        lex->byte_class[c] = cls;
+    }
+
+    struct lex_state normal = {LEX_NORMAL, 0, 1, 0, -1, 0, 0};
+    struct lex_state comment = {LEX_ML_COMMENT, 0, 0, 0, -1, 0, 0};
+    struct lex_state line = {LEX_LINE_COMMENT, 0, 0, 0, -1, 0, 0};
+    lex->start = lexer_intern(b, &normal);
+    lex->start_comment = has_ml ? lexer_intern(b, &comment) : lex->start;
+    lex->line_comment = -1;
+
+    int cap = 0;
+    for (int id = 0; id < b->n_states; id++) {
+        if (b->n_states > cap) {
+            cap = b->n_states * 2;
+            lex->edges = realloc(
+                lex->edges, sizeof(struct lexer_edge) * cap * lex->n_classes);
+            lex->eol_back =
+                realloc(lex->eol_back, sizeof(unsigned short) * cap);
+            lex->eol_hl = realloc(lex->eol_hl, cap);
+            lex->in_comment = realloc(lex->in_comment, cap);
+        }
+        struct lex_state s = b->states[id];
+        for (int cls = 0; cls < lex->n_classes; cls++) {
+            struct lexer_edge *e = &lex->edges[id * lex->n_classes + cls];
+            struct lex_state next =
+                lexer_step(b, &s, representative[cls], e);
+            e->next = lexer_intern(b, &next);
+        }
+    }
+
+    lex->n_states = b->n_states;
+    for (int id = 0; id < lex->n_states; id++) {
+        struct lex_state *s = &b->states[id];
+        lex->eol_back[id] = 0;
+        lex->eol_hl[id] = HL_NORMAL;
+        if (s->mode == LEX_NORMAL && !s->prev_sep && s->kw >= 0 &&
+            b->keywords->kind[s->kw] != HL_NORMAL) {
+            // the end of the row is a separator too
+            lex->eol_back[id] = b->keywords->depth[s->kw];
+            lex->eol_hl[id] = b->keywords->kind[s->kw];
+        }
+        lex->in_comment[id] = s->mode == LEX_ML_COMMENT;
+        if (!memcmp(s, &line, sizeof(line))) {
+            lex->line_comment = id;
+        }
+    }
+
+    keyword_trie_free(b->keywords);
+    free(b->kmp_next);
+    free(b->states);
+    free(b->keys);
+    free(b->ids);
+    free(b);
+    lex->compile_ns = now_ns() - start;
+    return lex;
+}
+
+/**
+ * Run the lexer over `s[0, len)`, entered inside a multiline comment if
+ * `in_comment`, filling `hl` unless it is NULL. Returns whether the text
+ * ends inside a multiline comment.
+ */
+int lexer_run(struct lexer *lex, const char *s, int len, unsigned char *hl,
+              int in_comment) {
+    int state = in_comment ? lex->start_comment : lex->start;
+    int i;
+    for (i = 0; i < len; i++) {
+        if (state == lex->line_comment) {
+            if (hl) memset(&hl[i], HL_COMMENT, len - i);
+            break;
+        }
+        struct lexer_edge *e =
+            &lex->edges[state * lex->n_classes +
+                        lex->byte_class[(unsigned char)s[i]]];
+        if (hl) {
+            if (e->back) memset(&hl[i - e->back], e->back_hl, e->back);
+            hl[i] = e->hl;
+        }
+        state = e->next;
+    }
+    if (hl && i == len && lex->eol_back[state]) {
+        memset(&hl[len - lex->eol_back[state]], lex->eol_hl[state],
+               lex->eol_back[state]);
+    }
+    return lex->in_comment[state];
+}
+
+/*** syntax highlighting ***/
+
+/**
+ * Go through all chars in an editor_row, starting inside a multiline comment
+ * if `in_comment`, and highlight them by setting each value in the hl array
+ */
+void editor_update_syntax(struct editor_row *row, int in_comment) {
+    row->hl = realloc(row->hl, row->rsize);
+    row->hl_in_comment = in_comment;
+    row->hl_state_valid = 1;
+
+    if (E.syntax == NULL) {
+        memset(row->hl, HL_NORMAL, row->rsize);
+        row->hl_open_comment = 0;
+        return;
+    }
+
+    // whether the row ended as an unclosed multiline comment or not
+    row->hl_open_comment = lexer_run(E.syntax->lexer, row->render, row->rsize,
+                                     row->hl, in_comment);
+}
+
+/**
+ * The comment state a row leaves, given the state it is entered in: the
+ * lexer run over `chars`, without building `render` or `hl`. Tabs are
+ * separators just like the spaces they render as.
+ */
+int editor_scan_state(struct editor_row *row, int in_comment) {
+    if (E.syntax == NULL) {
+        return 0;
+    }
+    return lexer_run(E.syntax->lexer, row->chars, row->size, NULL, in_comment);
+}
+
+int editor_hl_rescan_row(int row_idx) {
+    int in = (row_idx > 0) ? editor_row_at(row_idx - 1)->hl_open_comment : 0;
+    struct editor_row *row = editor_row_at(row_idx);
+    if (row->hl_state_valid && row->hl_in_comment == in) {
+        return 0;
+    }
+    row->hl_open_comment = editor_scan_state(row, in);
+    row->hl_in_comment = in;
+    row->hl_state_valid = 1;
+    // `hl` was built from another incoming state
+    free(row->hl);
+    row->hl = NULL;
+    return 1;
+}
+
+/**
+ * Move the highlight horizon past `upto`, rescanning rows whose stored
+ * states do not hold for the state they are entered in. Gives up once
+ * `deadline` (if not 0) has passed; returns whether `upto` was reached.
+ */
+int editor_hl_resolve(int upto, uint64_t deadline) {
+    int scanned = 0;
+    while (E.hl_horizon <= upto && E.hl_horizon < E.num_rows) {
+        // reading the clock costs more than checking a row
+        if (deadline && (++scanned & 255) == 0 && now_ns() > deadline) {
+            return 0;
+        }
+        editor_hl_rescan_row(E.hl_horizon);
+        E.hl_horizon++;
+    }
+    return 1;
+}
+
+struct hl_parallel_job {
+    struct editor_row **rows;
+    int num_rows;
+    int chunk_rows;
+};
+
+/**
+ * Scan one chunk of rows, guessing that the first is not entered inside a
+ * comment (true of most rows)
+ */
+void editor_hl_scan_chunk(void *arg, int chunk) {
+    struct hl_parallel_job *job = arg;
+    int start = chunk * job->chunk_rows;
+    int end = start + job->chunk_rows;
+    if (end > job->num_rows) end = job->num_rows;
+
+    int in = 0;
+    for (int j = start; j < end; j++) {
+        struct editor_row *row = job->rows[j];
+        row->hl_in_comment = in;
+        row->hl_open_comment = in = editor_scan_state(row, in);
+        row->hl_state_valid = 1;
+    }
+}
+
+/**
+ * Resolve the comment state of every row on `n_threads` threads. Chunks of
+ * rows are scanned in parallel from a guessed incoming state, then the
+ * chunks whose guess was wrong are rescanned in order, each only until its
+ * states agree with what the chunk before it leaves.
+ */
+void editor_hl_resolve_parallel(int n_threads) {
+    if (E.syntax == NULL || E.num_rows == 0) {
+        return;
+    }
+    struct hl_parallel_job job;
+    job.num_rows = E.num_rows;
+    job.rows = malloc(sizeof(struct editor_row *) * E.num_rows);
+    for (int j = 0; j < E.num_rows; j++) {
+        job.rows[j] = editor_row_at(j);
+        free(job.rows[j]->hl);
+        job.rows[j]->hl = NULL;
+    }
+    // a few chunks per thread, so one slow chunk does not hold up the rest
+    int n_chunks = n_threads * 4;
+    job.chunk_rows = (E.num_rows + n_chunks - 1) / n_chunks;
+    n_chunks = (E.num_rows + job.chunk_rows - 1) / job.chunk_rows;
+    worker_pool_run(n_threads, n_chunks, editor_hl_scan_chunk, &job);
+
+    int fixed = 0;  // rows before this one are known to be right
+    for (int c = 1; c < n_chunks; c++) {
+        int j = c * job.chunk_rows;
+        if (j < fixed) continue;
+        int in = job.rows[j - 1]->hl_open_comment;
+        while (j < E.num_rows && job.rows[j]->hl_in_comment != in) {
+            struct editor_row *row = job.rows[j];
+            row->hl_in_comment = in;
+            row->hl_open_comment = in = editor_scan_state(row, in);
+            j++;
+        }
+        fixed = j;
+    }
+    E.hl_horizon = E.num_rows;
+    free(job.rows);
+}
+
+/**
+ * Bring the comment states below a row whose `chars` just changed up to date.
+ * Rows are rescanned forward one at a time until one is entered in the same
+ * state as before, past which nothing can change. If that takes more than
+ * the highlight budget, the horizon is pulled back to where we stopped and
+ * the rest is left to background highlighting.
+ */
+void editor_hl_propagate(int row_idx) {
+    uint64_t deadline = now_ns() + KILO_HL_BUDGET_MS * 1000000ULL;
+    for (int k = row_idx; k < E.hl_horizon; k++) {
+        if (((k - row_idx) & 255) == 255 && now_ns() > deadline) {
+            E.hl_horizon = k;
+            return;
+        }
+        if (!editor_hl_rescan_row(k) && k > row_idx) {
+            return;  // converged
+        }
+    }
+}
+
+int editor_hl_pending() {
+    return E.syntax && E.syntax->multiline_comment_start &&
+           E.hl_horizon < E.num_rows;
+}
+
+/**
+ * Advance background highlighting for one time slice
+ */
+void editor_hl_step() {
+    editor_hl_resolve(E.num_rows - 1,
+                      now_ns() + KILO_HL_BUDGET_MS * 1000000ULL);
+    if (E.hl_guessed && E.hl_horizon >= E.rowoff + E.screen_rows) {
+        // the guesses on screen can be checked now
+        editor_refresh_screen();
+    }
+}
+
+/**
+ * Drop every row's highlighting, e.g. because the syntax changed
+ */
+void editor_invalidate_syntax() {
+    for (int j = 0; j < E.num_rows; j++) {
+        struct editor_row *row = editor_row_at(j);
+        free(row->hl);
+        row->hl = NULL;
+        row->hl_state_valid = 0;
+    }
+    E.hl_horizon = 0;
+    E.hl_guessed = 0;
+}
+
+int editor_syntax_to_color(int hl) {
+    switch (hl) {
+        case HL_ML_COMMENT:
+        case HL_COMMENT:
+            return 36;  // cyan
+        case HL_RESERVED_KEYWORD:
+            return 33;  // yellow
+        case HL_RESERVED_TYPE:
+            return 32;  // green
+        case HL_STRING:
+            return 35;  // magenta
+        case HL_NUMBER:
+            // 31 is the red foreground color
+            // https://en.wikipedia.org/wiki/ANSI_escape_code#3-bit_and_4-bit
+            return 31;
+        case HL_MATCH:
+            return 34;
+        default:
+            // 39 is the white foreground color
+            return 37;
+    }
+}
+
+/**
+ * Tries to match the current filename to one of the `filematch` fields
+ * in HLDB
+ */
+void editor_select_syntax_highlight() {
+    E.syntax = NULL;
+    if (E.filename == NULL) {
+        editor_invalidate_syntax();
+        return;
+    }
+
+    char *ext = strchr(E.filename, '.');  // first occurrence
+    for (int j = 0; j < syntax_db_len + (int)HLDB_ENTRIES; j++) {
+        struct editor_syntax *s =
+            j < syntax_db_len ? &syntax_db[j] : &HLDB[j - syntax_db_len];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->lexer == NULL) {
+                    s->lexer = lexer_compile(s);
+                }
+                editor_invalidate_syntax();
+                return;
+            }
+            i++;
+        }
+    }
+    editor_invalidate_syntax();
+}
+
+/*** syntax files ***/
+
+/**
+ * Split `line` in place into whitespace separated words, returned as a NULL
+ * terminated array of copies
+ */
+char **syntax_split_words(char *line) {
+    char **words = NULL;
+    int n = 0;
+    for (char *w = strtok(line, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+        words = realloc(words, sizeof(char *) * (n + 2));
+        words[n++] = strdup(w);
+    }
+    if (words == NULL) {
+        words = malloc(sizeof(char *));
+    }
+    words[n] = NULL;
+    return words;
+}
+
+void syntax_free_words(char **words) {
+    for (int j = 0; words && words[j]; j++) {
+        free(words[j]);
+    }
+    free(words);
+}
+
+/**
+ * Append `words` to the NULL terminated `list`, each followed by `suffix`
+ */
+char **syntax_append_words(char **list, char **words, char *suffix) {
+    int n = 0, m = 0;
+    while (list && list[n]) n++;
+    while (words[m]) m++;
+    list = realloc(list, sizeof(char *) * (n + m + 1));
+    for (int j = 0; j < m; j++) {
+        list[n + j] = malloc(strlen(words[j]) + strlen(suffix) + 1);
+        sprintf(list[n + j], "%s%s", words[j], suffix);
+    }
+    list[n + m] = NULL;
+    return list;
+}
+
+/**
+ * Parse a syntax definition, one directive per line:
+ *
+ *     filetype python
+ *     filematch .py .pyw
+ *     keywords if else return
+ *     types int str
+ *     comment #
+ *     multiline_comment {- -}
+ *     highlight numbers strings
+ *
+ * `filematch`, `keywords` and `types` may repeat. Blank lines and lines
+ * starting with `#` are skipped. Comment delimiters too long for the lexer,
+ * and keywords or types with a separator such as `.` in them, which the
+ * lexer cannot match, are dropped, with `*error` saying so. Returns 0 when
+ * the file has no `filetype` or `filematch`.
+ */
+int syntax_parse_file(FILE *fp, struct editor_syntax *s, const char **error) {
+    memset(s, 0, sizeof(struct editor_syntax));
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, fp) != -1) {
+        if (line[0] == '#') continue;
+        char **words = syntax_split_words(line);
+        char *directive = words[0];
+        if (directive == NULL) {
+            free(words);
+            continue;
+        }
+        char **args = &words[1];
+        int n_args = 0;
+        while (args[n_args]) n_args++;
+
+        if (!strcmp(directive, "filetype") && n_args == 1) {
+            free(s->filetype);
+            s->filetype = strdup(args[0]);
+        } else if (!strcmp(directive, "filematch")) {
+            s->filematch = syntax_append_words(s->filematch, args, "");
+        } else if (!strcmp(directive, "keywords")) {
+            s->reserveds = syntax_append_words(s->reserveds, args, "");
+        } else if (!strcmp(directive, "types")) {
+            s->reserveds = syntax_append_words(s->reserveds, args, "|");
+        } else if (!strcmp(directive, "comment") && n_args == 1) {
+            free(s->singleline_comment_start);
+            s->singleline_comment_start = strdup(args[0]);
+        } else if (!strcmp(directive, "multiline_comment") && n_args == 2) {
+            free(s->multiline_comment_start);
+            free(s->multiline_comment_end);
+            s->multiline_comment_start = strdup(args[0]);
+            s->multiline_comment_end = strdup(args[1]);
+        } else if (!strcmp(directive, "highlight")) {
+            for (int j = 0; j < n_args; j++) {
+                if (!strcmp(args[j], "numbers")) {
+                    s->flags |= HL_HIGHLIGHT_NUMBERS;
+                } else if (!strcmp(args[j], "strings")) {
+                    s->flags |= HL_HIGHLIGHT_STRINGS;
+                }
+            }
+        }
+        syntax_free_words(words);
+    }
+    free(line);
+
+    *error = NULL;
+    // a word ends at a separator, so a keyword can only be matched up to one
+    int kept = 0;
+    for (int j = 0; s->reserveds && s->reserveds[j]; j++) {
+        char *word = s->reserveds[j];
+        int len = strlen(word);
+        if (has_separator(word, word[len - 1] == '|' ? len - 1 : len)) {
+            free(word);
+            *error = "keywords with separators";
+            continue;
+        }
+        s->reserveds[kept++] = word;
+    }
+    if (s->reserveds) {
+        s->reserveds[kept] = NULL;
+    }
+    int comment_len =
+        s->singleline_comment_start ? strlen(s->singleline_comment_start) : 0;
+    if (comment_len > LEX_MAX_COMMENT_OPENERS) {
+        free(s->singleline_comment_start);
+        s->singleline_comment_start = NULL;
+        comment_len = 0;
+        *error = "comment too long";
+    }
+    if (s->multiline_comment_start &&
+        (comment_len + (int)strlen(s->multiline_comment_start) >
+             LEX_MAX_COMMENT_OPENERS ||
+         strlen(s->multiline_comment_end) > LEX_MAX_COMMENT_END)) {
+        free(s->multiline_comment_start);
+        free(s->multiline_comment_end);
+        s->multiline_comment_start = NULL;
+        s->multiline_comment_end = NULL;
+        *error = "multiline_comment too long";
+    }
+    return s->filetype && s->filematch;
+}
+
+/**
+ * Load every `*.syntax` file in `dir` into `syntax_db`, skipping filetypes
+ * that are already defined
+ */
+void syntax_load_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        int len = strlen(ent->d_name);
+        if (len <= 7 || strcmp(&ent->d_name[len - 7], ".syntax")) continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) continue;
+        struct editor_syntax s;
+        const char *error;
+        int ok = syntax_parse_file(fp, &s, &error);
+        fclose(fp);
+        if (error) {
+            editor_set_status_message("%s: %s, ignored", ent->d_name, error);
+        }
+
+        for (int j = 0; ok && j < syntax_db_len; j++) {
+            ok = strcmp(syntax_db[j].filetype, s.filetype) != 0;
+        }
+        if (!ok) {
+            // the definition is leaked; there are only ever a handful
+            continue;
+        }
+        syntax_db = realloc(syntax_db,
+                            sizeof(struct editor_syntax) * (syntax_db_len + 1));
+        syntax_db[syntax_db_len++] = s;
+    }
+    closedir(d);
+}
+
+/**
+ * Load syntax definitions from `$KILO_SYNTAX_DIR`, then
+ * `$XDG_CONFIG_HOME/kilo/syntax` (or `~/.config/kilo/syntax`), then the ones
+ * installed with kilo; the first definition of a filetype wins, and all of
+ * them win over the built-in `HLDB`. Each is compiled into a lexer only when
+ * first selected.
+ */
+void editor_load_syntaxes() {
+    char path[PATH_MAX];
+    char *dir = getenv("KILO_SYNTAX_DIR");
+    if (dir && *dir) {
+        syntax_load_dir(dir);
+    }
+
+    char *config = getenv("XDG_CONFIG_HOME");
+    char *home = getenv("HOME");
+    if (config && *config) {
+        snprintf(path, sizeof(path), "%s/kilo/syntax", config);
+        syntax_load_dir(path);
+    } else if (home && *home) {
+        snprintf(path, sizeof(path), "%s/.config/kilo/syntax", home);
+        syntax_load_dir(path);
+    }
+
+#ifdef KILO_SYNTAX_DIR
+    syntax_load_dir(KILO_SYNTAX_DIR);
+#endif
+}
+
+/*** snapshots ***/
+
+/**
+ * The text of every row at one moment, for a worker thread to read while the
+ * main thread goes on editing. Taking one marks the rows `shared`: editing a
+ * shared row copies its text first, just like a row still in the file
+ * mapping, and the old buffer is kept on `E.retired` until the last snapshot
+ * is released. Snapshots are only taken and released on the main thread.
+ */
+struct snapshot_row {
+    const char *chars;
+    int size;
+    uint32_t id;
+};
+
+struct snapshot {
+    int refs;
+    unsigned long version;  // `E.version` when taken
+    int num_rows;
+    struct snapshot_row *rows;
+};
+
+void editor_snapshot_release(struct snapshot *s) {
+    if (s == NULL || --s->refs > 0) {
+        return;
+    }
+    free(s->rows);
+    free(s);
+    if (--E.snapshots_live == 0) {
+        for (int j = 0; j < E.n_retired; j++) {
+            free(E.retired[j]);
+        }
+        E.n_retired = 0;
+    }
+}
+
+/**
+ * Copy the rows under `node` into `rows`, marking them shared; returns how
+ * many there were
+ */
+int snapshot_add_rows(struct row_node *node, struct snapshot_row *rows) {
+    if (!node->is_leaf) {
+        int n = 0;
+        for (int i = 0; i < node->n; i++) {
+            n += snapshot_add_rows(node->children[i], &rows[n]);
+        }
+        return n;
+    }
+    for (int j = 0; j < node->n; j++) {
+        struct editor_row *row = &node->rows[j];
+        row->shared = !row->mapped;
+        rows[j].chars = row->chars;
+        rows[j].size = row->size;
+        rows[j].id = row->id;
+    }
+    return node->n;
+}
+
+/**
+ * A snapshot of the rows as they are now. Consecutive calls without an edit
+ * in between share one snapshot.
+ */
+struct snapshot *editor_snapshot_take() {
+    if (E.snapshot && E.snapshot->version == E.version) {
+        E.snapshot->refs++;
+        return E.snapshot;
+    }
+    editor_snapshot_release(E.snapshot);
+
+    struct snapshot *s = malloc(sizeof(struct snapshot));
+    s->refs = 2;  // the caller's, and `E.snapshot`'s
+    s->version = E.version;
+    s->num_rows = E.num_rows;
+    s->rows = malloc(sizeof(struct snapshot_row) * (E.num_rows + 1));
+    // leaf by leaf, rather than looking up each row
+    snapshot_add_rows(E.rows.root, s->rows);
+    E.snapshots_live++;
+    E.snapshot = s;
+    return s;
+}
+
+/**
+ * Free a row buffer that a snapshot may still be reading, once none can be
+ */
+void editor_snapshot_retire(char *chars) {
+    if (E.snapshots_live == 0) {
+        free(chars);
+        return;
+    }
+    if (E.n_retired == E.cap_retired) {
+        E.cap_retired = E.cap_retired ? E.cap_retired * 2 : 64;
+        E.retired = realloc(E.retired, sizeof(char *) * E.cap_retired);
+    }
+    E.retired[E.n_retired++] = chars;
+}
+
+/**
+ * Note that the text changed
+ */
+void editor_mark_dirty() {
+    E.dirty++;
+    E.version++;
+    E.edited_ns = now_ns();
+    if (E.snapshot) {
+        // nobody else can take this one any more
+        struct snapshot *s = E.snapshot;
+        E.snapshot = NULL;
+        editor_snapshot_release(s);
+    }
+}
+
+/*** trigram index ***/
+
+/**
+ * Which rows contain each trigram, so that a search only has to look at
+ * rows that contain every trigram of the query. Positions shift with every
+ * insert and delete, so rows are known by `id` instead: ids are handed out
+ * in row order when the index is built, and a row gets a fresh one whenever
+ * its text changes and is indexed again. Stale entries only cost a wasted
+ * check. Ids are indexed in groups of 1 << KILO_INDEX_GROUP_SHIFT to keep
+ * the index small.
+ *
+ * Each bucket lists the groups containing a trigram that hashes to it, in
+ * increasing order, as varint deltas. ASCII letters are folded to lower
+ * case, so one index serves searches with and without case.
+ */
+#define TRIGRAM_BUCKET_BITS 18
+
+struct trigram_bucket {
+    unsigned char *data;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t last;  // the last group added, if `len`
+};
+
+struct trigram_index {
+    struct trigram_bucket *buckets;
+};
+
+struct trigram_index *trigram_index_new() {
+    struct trigram_index *t = malloc(sizeof(struct trigram_index));
+    t->buckets =
+        calloc(1 << TRIGRAM_BUCKET_BITS, sizeof(struct trigram_bucket));
+    return t;
+}
+
+void trigram_index_free(struct trigram_index *t) {
+    if (t == NULL) {
+        return;
+    }
+    for (int b = 0; b < 1 << TRIGRAM_BUCKET_BITS; b++) {
+        free(t->buckets[b].data);
+    }
+    free(t->buckets);
+    free(t);
+}
+
+/**
+ * Memory the index takes up
+ */
+size_t trigram_index_bytes(struct trigram_index *t) {
+    size_t bytes = sizeof(struct trigram_bucket) << TRIGRAM_BUCKET_BITS;
+    for (int b = 0; b < 1 << TRIGRAM_BUCKET_BITS; b++) {
+        bytes += t->buckets[b].cap;
+    }
+    return bytes;
+}
+
+unsigned char trigram_fold(unsigned char c) {
+    return c | ((unsigned char)(c - 'A') < 26) << 5;
+}
+
+uint32_t trigram_hash(uint32_t trigram) {
+    return (trigram * 2654435761u) >> (32 - TRIGRAM_BUCKET_BITS);
+}
+
+void trigram_bucket_add(struct trigram_bucket *b, uint32_t group) {
+    if (b->len && b->last == group) {
+        return;
+    }
+    uint32_t delta = b->len ? group - b->last : group;
+    if (b->len + 5 > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 8;
+        b->data = realloc(b->data, b->cap);
+    }
+    while (delta >= 0x80) {
+        b->data[b->len++] = delta | 0x80;
+        delta >>= 7;
+    }
+    b->data[b->len++] = delta;
+    b->last = group;
+}
+
+/**
+ * Index the text of the row with `id`. Ids must not decrease from one call
+ * to the next.
+ */
+void trigram_index_add(struct trigram_index *t, uint32_t id, const char *s,
+                       int len) {
+    uint32_t group = id >> KILO_INDEX_GROUP_SHIFT;
+    uint32_t trigram = 0;
+    for (int i = 0; i < len; i++) {
+        trigram = (trigram << 8 | trigram_fold(s[i])) & 0xffffff;
+        if (i >= 2) {
+            trigram_bucket_add(&t->buckets[trigram_hash(trigram)], group);
+        }
+    }
+}
+
+/**
+ * Decode the groups of a bucket into `out`, returning how many there were
+ */
+int trigram_bucket_decode(struct trigram_bucket *b, uint32_t *out) {
+    int n = 0;
+    uint32_t group = 0;
+    for (uint32_t i = 0; i < b->len;) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (b->data[i] & 0x80) {
+            delta |= (uint32_t)(b->data[i++] & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t)b->data[i++] << shift;
+        group = n ? group + delta : delta;
+        out[n++] = group;
+    }
+    return n;
+}
+
+int trigram_bucket_cmp(const void *a, const void *b) {
+    uint32_t la = (*(struct trigram_bucket *const *)a)->len;
+    uint32_t lb = (*(struct trigram_bucket *const *)b)->len;
+    return (la > lb) - (la < lb);
+}
+
+/**
+ * Set the bits in `groups` of every group that may contain the needle.
+ * Needles shorter than a trigram tell nothing; returns 0 for those.
+ */
+int trigram_index_query(struct trigram_index *t,
+                        const struct search_needle *n, uint64_t *groups) {
+    if (n->len < 3) {
+        return 0;
+    }
+    int n_buckets = 0;
+    struct trigram_bucket **buckets =
+        malloc(sizeof(struct trigram_bucket *) * n->len);
+    uint32_t trigram = 0;
+    for (int i = 0; i < n->len; i++) {
+        trigram = (trigram << 8 | trigram_fold(n->s[i])) & 0xffffff;
+        if (i < 2) continue;
+        struct trigram_bucket *b = &t->buckets[trigram_hash(trigram)];
+        int seen = 0;
+        for (int j = 0; j < n_buckets; j++) {
+            seen |= buckets[j] == b;
+        }
+        if (!seen) buckets[n_buckets++] = b;
+    }
+    // start from the rarest trigram, so the candidates only shrink from there
+    qsort(buckets, n_buckets, sizeof(struct trigram_bucket *),
+          trigram_bucket_cmp);
+
+    // a group takes at least a byte, so `len` bounds the count
+    uint32_t *cand = malloc(sizeof(uint32_t) * (buckets[0]->len + 1));
+    uint32_t *other = NULL;
+    int n_cand = trigram_bucket_decode(buckets[0], cand);
+    for (int j = 1; j < n_buckets && n_cand; j++) {
+        other = realloc(other, sizeof(uint32_t) * (buckets[j]->len + 1));
+        int n_other = trigram_bucket_decode(buckets[j], other);
+        int kept = 0;
+        for (int a = 0, b = 0; a < n_cand && b < n_other;) {
+            if (cand[a] < other[b]) {
+                a++;
+            } else if (cand[a] > other[b]) {
+                b++;
+            } else {
+                cand[kept++] = cand[a];
+                a++;
+                b++;
+            }
+        }
+        n_cand = kept;
+    }
+    for (int a = 0; a < n_cand; a++) {
+        groups[cand[a] / 64] |= 1ULL << (cand[a] % 64);
+    }
+    free(cand);
+    free(other);
+    free(buckets);
+    return 1;
+}
+
+/**
+ * Building the index of the file on a worker thread, over a snapshot
+ */
+struct index_build {
+    struct snapshot *snap;
+    struct trigram_index *index;
+    uint64_t elapsed_ns;
+    int done;    // set by the worker when it is finished
+    int joined;  // the main thread has waited for the worker
+    pthread_t thread;
+};
+
+void *index_build_thread(void *arg) {
+    struct index_build *b = arg;
+    uint64_t start = now_ns();
+    for (int j = 0; j < b->snap->num_rows; j++) {
+        trigram_index_add(b->index, j, b->snap->rows[j].chars,
+                          b->snap->rows[j].size);
+    }
+    b->elapsed_ns = now_ns() - start;
+    __atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+    event_loop_wake();
+    return NULL;
+}
+
+/**
+ * Start indexing the file in the background. Until that is done, rows that
+ * change are indexed on the side, in `E.index_edits`.
+ */
+void editor_index_start() {
+    for (int j = 0; j < E.num_rows; j++) {
+        editor_row_at(j)->id = j;
+    }
+    E.next_row_id = E.num_rows;
+    E.index_edits = trigram_index_new();
+
+    struct index_build *b = calloc(1, sizeof(struct index_build));
+    b->snap = editor_snapshot_take();
+    b->index = trigram_index_new();
+    if (pthread_create(&b->thread, NULL, index_build_thread, b) != 0) {
+        index_build_thread(b);
+        b->joined = 1;
+    }
+    E.index_build = b;
+}
+
+/**
+ * Install the index once the worker has built it. Returns whether it did.
+ */
+int editor_index_poll() {
+    struct index_build *b = E.index_build;
+    if (b == NULL || !__atomic_load_n(&b->done, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (!b->joined) {
+        pthread_join(b->thread, NULL);
+    }
+    E.index = b->index;
+    editor_set_status_message(
+        "Indexed %d lines in %.0f ms (%.1f MB)", b->snap->num_rows,
+        b->elapsed_ns / 1e6,
+        (trigram_index_bytes(E.index) + trigram_index_bytes(E.index_edits)) /
+            1048576.0);
+    editor_snapshot_release(b->snap);
+    free(b);
+    E.index_build = NULL;
+    return 1;
+}
+
+/**
+ * Index the changed text of a row under a fresh id
+ */
+void editor_index_row(struct editor_row *row) {
+    if (E.index_edits == NULL) {
+        return;
+    }
+    row->id = E.next_row_id++;
+    trigram_index_add(E.index_edits, row->id, row->chars, row->size);
+}
+
+/**
+ * Length in words of a bitset of the groups of ids below `limit`
+ */
+size_t index_groups_words(uint32_t limit) {
+    return ((limit >> KILO_INDEX_GROUP_SHIFT) + 1) / 64 + 1;
+}
+
+/**
+ * Which row ids below `*limit` may contain the needle, as a bitset of
+ * groups; rows at or past `*limit` were indexed later and may match too.
+ * NULL if every row has to be searched.
+ */
+uint64_t *editor_index_candidates(const struct search_needle *n,
+                                  uint32_t *limit) {
+    if (E.index == NULL) {
+        return NULL;
+    }
+    *limit = E.next_row_id;
+    uint64_t *groups = calloc(index_groups_words(*limit), sizeof(uint64_t));
+    if (!trigram_index_query(E.index, n, groups) ||
+        !trigram_index_query(E.index_edits, n, groups)) {
+        free(groups);
+        return NULL;
+    }
+    return groups;
+}
+
+/**
+ * Whether the row with `id` can contain the needle `groups` was made for
+ */
+int index_candidate(uint64_t *groups, uint32_t limit, uint32_t id) {
+    if (groups == NULL || id >= limit) {
+        return 1;
+    }
+    uint32_t group = id >> KILO_INDEX_GROUP_SHIFT;
+    return (groups[group / 64] >> (group % 64)) & 1;
+}
+
+/*** row operations ***/
+
+/**
+ * Convert a `chars` index into a `render` index
+ */
+int editor_row_cx_to_rx(struct editor_row *row, int cx) {
+    // loop through all characters to the left of `cx`
+    int rx = 0;
+    int j;
+    for (j = 0; j < cx; j++) {
+        if (row->chars[j] == '\t') {
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        }
+        rx++;
+    }
+    return rx;
+}
+
+/**
+ * Convert a `render` index into a `chars` index
+ */
+int editor_row_rx_to_cx(struct editor_row *row, int rx) {
+    int curr_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t') {
+            curr_rx += (KILO_TAB_STOP - 1) - (curr_rx % KILO_TAB_STOP);
+        }
+        curr_rx++;
+        if (curr_rx > rx) {
+            return cx;
+        }
+    }
+
+    return cx;
+}
+
+/**
+ * Expand tabs in `chars` into `render`
+ */
+void editor_update_render(struct editor_row *row) {
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            tabs++;
+        }
+    }
+    free(row->render);
+    // each tab is 8 chars; initial row->size already has one char for each tab
+    // including '\0'
+    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';  // advance the cursor at least one space
+            while (idx % KILO_TAB_STOP != 0) {
+                // until running into tabstop
+                row->render[idx++] = ' ';
+            }
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+/**
+ * Drop the `render` and `hl` of a row whose `chars` changed, to be rebuilt
+ * when it is next drawn
+ */
+void editor_row_invalidate(struct editor_row *row) {
+    free(row->render);
+    row->render = NULL;
+    free(row->hl);
+    row->hl = NULL;
+    row->hl_state_valid = 0;
+    editor_index_row(row);
+}
+
+/**
+ * Called whenever the `chars` of a row change: drop its `render` and `hl`,
+ * and update the comment states of the rows below if they depend on it
+ */
+void editor_update_row(int row_idx) {
+    editor_row_invalidate(editor_row_at(row_idx));
+    if (row_idx < E.hl_horizon) {
+        editor_hl_propagate(row_idx);
+    }
+}
+
+/**
+ * Make sure `render` and `hl` of the row at `row_idx` are up to date, and
+ * return the row. Only the comment states of the rows between the highlight
+ * horizon and this row are computed along the way; if that is not done by
+ * `deadline` (0 for no limit), the row is highlighted from the state it was
+ * last entered in, and redrawn once background highlighting gets there.
+ */
+struct editor_row *editor_row_materialize(int row_idx, uint64_t deadline) {
+    struct editor_row *row = editor_row_at(row_idx);
+    if (row == NULL) {
+        return NULL;
+    }
+    if (row->render == NULL) {
+        editor_update_render(row);
+    }
+    int in;
+    if (editor_hl_resolve(row_idx - 1, deadline)) {
+        in = (row_idx > 0) ? editor_row_at(row_idx - 1)->hl_open_comment : 0;
+    } else {
+        in = row->hl_state_valid ? row->hl_in_comment : 0;
+        E.hl_guessed = 1;
+    }
+    if (row->hl == NULL || !row->hl_state_valid || row->hl_in_comment != in) {
+        editor_update_syntax(row, in);
+        if (row_idx == E.hl_horizon) {
+            E.hl_horizon++;
+        }
+    }
+    return row;
+}
+
+/**
+ * Give a row that borrows its text from the file mapping, or shares it with a
+ * snapshot, a copy of its own, so that it can be edited
+ */
+void editor_row_own(struct editor_row *row) {
+    if (!row->mapped && !row->shared) {
+        return;
+    }
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (row->shared) {
+        editor_snapshot_retire(row->chars);
+    }
+    row->chars = chars;
+    row->mapped = 0;
+    row->shared = 0;
+}
+
+void editor_insert_row(int at_row, char *s, size_t len) {
+    if (at_row < 0 || at_row > E.num_rows) {
+        return;
+    }
+    struct editor_row *row = row_tree_insert(&E.rows, at_row);
+    E.num_rows++;
+    if (at_row < E.hl_horizon) {
+        E.hl_horizon++;  // the rows below moved down with their states
+    }
+
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+
+    editor_update_row(at_row);
+
+    editor_mark_dirty();
+}
+
+/**
+ * Fill the empty buffer with a bare row for each line of `buf` that `lines`
+ * has found, each row's text staying in the file mapping
+ */
+void editor_load_mapped_rows(char *buf, size_t len, struct line_index *lines) {
+    row_tree_load(&E.rows, lines->count);
+    E.num_rows = lines->count;
+    for (size_t i = 0; i < lines->count; i++) {
+        // in order, so each lookup is of the cached leaf or the next one
+        struct editor_row *row = editor_row_at(i);
+        row->size = line_index_line_len(lines, buf, len, i);
+        row->chars = &buf[lines->starts[i]];
+        row->mapped = 1;
+    }
+}
+
+/**
+ * Let go of the `chars` of a row, however the row holds them
+ */
+void editor_row_release_chars(struct editor_row *row) {
+    if (row->shared) {
+        editor_snapshot_retire(row->chars);
+    } else if (!row->mapped) {
+        free(row->chars);
+    }
+    row->shared = 0;
+    row->mapped = 0;
+}
+
+void editor_free_row(struct editor_row *row) {
+    free(row->render);
+    editor_row_release_chars(row);
+    free(row->hl);
+}
+
+void editor_del_row(int at) {
+    if (at < 0 || at >= E.num_rows) {
+        return;
+    }
+
+    editor_free_row(editor_row_at(at));
+    row_tree_delete(&E.rows, at);
+    E.num_rows--;
+    if (at < E.hl_horizon) {
+        // the row now at `at` is entered from a different row
+        E.hl_horizon--;
+        editor_hl_propagate(at);
+    }
+    editor_mark_dirty();
+}
+
+void editor_row_insert_char(int row_idx, int at, int c) {
+    struct editor_row *row = editor_row_at(row_idx);
+    if (at < 0 || at > row->size) {
+        at = row->size;  // by default append the char
+    }
+    editor_row_own(row);
+    // add 2 bytes - making room for the null byte
+    // because the memmove below _shifts_ the existing sub line to the right
+    // 1 byte;
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editor_update_row(row_idx);
+    editor_mark_dirty();
+}
+
+void editor_row_append_string(int row_idx, char *s, size_t len) {
+    struct editor_row *row = editor_row_at(row_idx);
+    editor_row_own(row);
+    // size does not include null byte
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editor_update_row(row_idx);
+    editor_mark_dirty();
+}
+
+void editor_row_del_char(int row_idx, int at) {
+    struct editor_row *row = editor_row_at(row_idx);
+    if (at < 0 || at >= row->size) return;
+    editor_row_own(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editor_update_row(row_idx);
+    editor_mark_dirty();
+}
+
+/*** editor operations ***/
+
+void editor_insert_char(int c) {
+    if (E.cy == E.num_rows) {
+        editor_insert_row(E.num_rows, "", 0);
+    }
+    editor_row_insert_char(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void editor_insert_new_line() {
+    if (E.cx == 0) {
+        // add a new empty line _BEFORE_ the current line
+        editor_insert_row(E.cy, "", 0);
+    } else {
+        struct editor_row *row = editor_row_at(E.cy);
+        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        // need to reassign the row pointer since `editor_insert_row()` may
+        // split the leaf holding it, which invalidates the pointer
+        row = editor_row_at(E.cy);
+        editor_row_own(row);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editor_update_row(E.cy);
+    }
+
+    E.cy++;
+    E.cx = 0;
+}
+
+/**
+ * Join `a` and `b` into a new string
+ */
+char *editor_join(const char *a, size_t a_len, const char *b, size_t b_len) {
+    char *s = malloc(a_len + b_len + 1);
+    memcpy(s, a, a_len);
+    memcpy(&s[a_len], b, b_len);
+    s[a_len + b_len] = '\0';
+    return s;
+}
+
+/**
+ * Insert `len` bytes of text, which may run over many lines, at the cursor
+ * and move the cursor past it. The text is split into lines in one scan, each
+ * row it makes is built once, and comment states are updated once at the
+ * end.
+ */
+void editor_insert_text(const char *s, size_t len) {
+    // on the line past the end, a line break adds a row before it and leaves
+    // the cursor past the end again, as typing one does
+    while (len > 0 && E.cy == E.num_rows && s[0] == '\n') {
+        editor_insert_new_line();
+        s++;
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (E.cy == E.num_rows) {
+        editor_insert_row(E.num_rows, "", 0);
+    }
+    struct line_index lines = {0};
+    line_index_scan(&lines, s, len);
+    // a final newline leaves the cursor at the start of one more line
+    int n = lines.count + (s[len - 1] == '\n');
+
+    // the current row keeps what is before the cursor, followed by the first
+    // line; what is after the cursor goes after the last line
+    struct editor_row *row = editor_row_at(E.cy);
+    char *head = row->chars;
+    int cx = E.cx, tail_len = row->size - E.cx;
+    int first_len = line_index_line_len(&lines, s, len, 0);
+    char *first = editor_join(head, cx, s, first_len);
+    char *last = NULL;
+    int last_len = 0;
+    if (n == 1) {
+        char *joined = editor_join(first, cx + first_len, &head[cx], tail_len);
+        free(first);
+        first = joined;
+        E.cx += first_len;
+    } else {
+        const char *line = "";
+        if (n - 1 < (int)lines.count) {
+            line = &s[lines.starts[n - 1]];
+            last_len = line_index_line_len(&lines, s, len, n - 1);
+        }
+        last = editor_join(line, last_len, &head[cx], tail_len);
+    }
+    editor_row_release_chars(row);
+    row->chars = first;
+    row->size = n == 1 ? cx + first_len + tail_len : cx + first_len;
+    editor_row_invalidate(row);
+
+    for (int i = 1; i < n; i++) {
+        row = row_tree_insert(&E.rows, E.cy + i);
+        if (i < n - 1) {
+            row->size = line_index_line_len(&lines, s, len, i);
+            row->chars = editor_join(&s[lines.starts[i]], row->size, "", 0);
+        } else {
+            row->size = last_len + tail_len;
+            row->chars = last;
+        }
+        editor_row_invalidate(row);
+    }
+    E.num_rows += n - 1;
+    if (E.cy < E.hl_horizon) {
+        // the rows below moved down with their states
+        E.hl_horizon += n - 1;
+        // the new rows have no states yet, so one rescan runs through all of
+        // them, and on below for as long as the states there change
+        editor_hl_propagate(E.cy);
+    }
+    if (n > 1) {
+        E.cy += n - 1;
+        E.cx = last_len;
+    }
+    line_index_free(&lines);
+    editor_mark_dirty();
+}
+
+void editor_del_char() {
+    if (E.cy == E.num_rows) {
+        return;
+    }
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+
+    if (E.cx > 0) {
+        editor_row_del_char(E.cy, E.cx - 1);  // delete char before the cursor
+        E.cx--;
+    } else {
+        struct editor_row *row = editor_row_at(E.cy);
+        E.cx = editor_row_at(E.cy - 1)->size;
+        editor_row_append_string(E.cy - 1, row->chars, row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+/*** file I/O ***/
+
+/**
+ * Write the rows of `snap` to `fd`, each followed by a newline, gathered
+ * into writev() calls of at most KILO_SAVE_CHUNK bytes. Rows still side by
+ * side in the file mapping go out as one piece, newlines included.
+ * `written` is kept up to date as it goes. Returns 0, or -1 with `errno` set.
+ */
+int snapshot_write(struct snapshot *snap, int fd, long long *written) {
+    struct iovec iov[IOV_MAX];
+    int n_iov = 0;
+    size_t batch = 0;
+    for (int j = 0; j < snap->num_rows; j++) {
+        struct snapshot_row *row = &snap->rows[j];
+        struct iovec *last = n_iov ? &iov[n_iov - 1] : NULL;
+        if (last && (char *)last->iov_base + last->iov_len == row->chars) {
+            last->iov_len += row->size;
+        } else {
+            iov[n_iov++] = (struct iovec){(char *)row->chars, row->size};
+        }
+        batch += row->size + 1;
+        if (j + 1 < snap->num_rows &&
+            row->chars + row->size + 1 == snap->rows[j + 1].chars &&
+            row->chars[row->size] == '\n') {
+            iov[n_iov - 1].iov_len++;  // the newline between them
+        } else {
+            iov[n_iov++] = (struct iovec){"\n", 1};
+        }
+
+        if (n_iov + 2 > IOV_MAX || batch >= KILO_SAVE_CHUNK ||
+            j + 1 == snap->num_rows) {
+            if (write_all(fd, iov, n_iov) == -1) {
+                return -1;
+            }
+            __atomic_store_n(written, *written + batch, __ATOMIC_RELAXED);
+            event_loop_wake();  // for the progress to be shown
+            n_iov = 0;
+            batch = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Make a rename in the directory of `path` stick
+ */
+void fsync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                      : strdup(".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/**
+ * The permissions a new file gets under the umask. Reading the umask means
+ * setting it, for the whole process, so this is for the main thread only.
+ */
+mode_t new_file_mode() {
+    mode_t mask = umask(0);
+    umask(mask);
+    return 0644 & ~mask;
+}
+
+/**
+ * Save `snap` as `filename`. The rows are written to a temporary file next to
+ * it, flushed to disk and renamed over it, so that a crash leaves either the
+ * old file or the new one, never a mix. The file keeps its permissions, and
+ * its owner where allowed; a symlink is followed, not replaced. A new file
+ * gets `new_mode`. Returns 0, or -1 with `errno` set.
+ */
+int snapshot_save(struct snapshot *snap, const char *filename,
+                  mode_t new_mode, long long *written) {
+    char *path = realpath(filename, NULL);
+    if (path == NULL) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+        path = strdup(filename);  // a new file
+    }
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+
+    size_t tmp_size = strlen(path) + 8;
+    char *tmp = malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(path);
+        return -1;
+    }
+    mode_t mode = new_mode;
+    if (exists) {
+        mode = st.st_mode & 07777;
+        // only root can give a file away; otherwise it becomes ours
+        int ignored = fchown(fd, st.st_uid, st.st_gid);
+        (void)ignored;
+    }
+
+    int ok = fchmod(fd, mode) == 0 && snapshot_write(snap, fd, written) == 0 &&
+             fsync(fd) == 0;
+    int error = errno;
+    if (close(fd) == -1 && ok) {
+        ok = 0;
+        error = errno;
+    }
+    if (ok && rename(tmp, path) == -1) {
+        ok = 0;
+        error = errno;
+    }
+    if (ok) {
+        fsync_dir(path);
+    } else {
+        unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    errno = error;
+    return ok ? 0 : -1;
+}
+
+/**
+ * Map the file open at `fd` read-only and add one bare row per line, each
+ * borrowing its text from the mapping. The rows themselves are made here, so
+ * this takes time in proportion to the number of lines, but only their line
+ * boundaries are found; the rest of a row is built once it is displayed,
+ * searched or edited, and work on the whole file waits for
+ * `editor_open_finish()`. Returns -1 if the file cannot be mapped.
+ */
+int editor_open_mapped(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    E.map = map;
+    E.map_len = st.st_size;
+
+    struct line_index idx = {0};
+    line_index_scan(&idx, map, E.map_len);
+    editor_load_mapped_rows(map, E.map_len, &idx);
+    line_index_free(&idx);
+
+    E.open_pending = 1;  // the rest once the first screen is up
+    return 0;
+}
+
+/**
+ * The work on the whole of a newly opened file, left until its first screen
+ * has been drawn: resolving every comment state, and indexing. Returns
+ * whether there was any.
+ */
+int editor_open_finish() {
+    if (!E.open_pending) {
+        return 0;
+    }
+    E.open_pending = 0;
+    // on one core, background highlighting does the same without blocking
+    if (editor_hl_pending() && E.num_rows >= KILO_HL_PARALLEL_ROWS &&
+        worker_pool_size() > 1) {
+        editor_hl_resolve_parallel(worker_pool_size());
+    }
+    if (E.map_len >= KILO_INDEX_MIN_BYTES) {
+        editor_index_start();
+    }
+    return 1;
+}
+
+void editor_open(char *filename) {
+    free(E.filename);
+    // assuming you will free this memory yourself
+    E.filename = strdup(filename);
+
+    // detect filetype after filename changes
+    editor_select_syntax_highlight();
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        die("fopen");
+    }
+    if (editor_open_mapped(fileno(fp)) == 0) {
+        fclose(fp);
+        E.dirty = 0;
+        return;
+    }
+
+    // not a regular file, e.g. a pipe; read it line by line
+    char *line = NULL;
+    size_t line_cap = 0;  // line capacity
+    // ssize_t - signed size_t; can store at least -1 to 2^15 - 1
+    ssize_t line_len;  // excluding '\0'
+    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+        while (line_len > 0 &&
+               (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+            line_len--;  // strips off the newline
+        }
+        editor_insert_row(E.num_rows, line, line_len);
+    }
+
+    if (line) free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+
+/**
+ * Saving the file on a worker thread, over a snapshot, so that editing can
+ * go on meanwhile
+ */
+struct save_job {
+    struct snapshot *snap;
+    char *filename;
+    mode_t mode;            // for the file, if it is new
+    int dirty;              // `E.dirty` when the snapshot was taken
+    long long total;        // bytes to write, once the worker has added up
+    long long written;      // so far
+    long long shown;        // as last shown in the status bar
+    int result;             // of `snapshot_save()`
+    int error;              // its `errno`
+    uint64_t elapsed_ns;
+    int done;    // set by the worker when it is finished
+    int joined;  // the main thread has waited for the worker
+    pthread_t thread;
+};
+
+void *save_thread(void *arg) {
+    struct save_job *s = arg;
+    uint64_t start = now_ns();
+    long long total = 0;
+    for (int j = 0; j < s->snap->num_rows; j++) {
+        total += s->snap->rows[j].size + 1;
+    }
+    __atomic_store_n(&s->total, total, __ATOMIC_RELAXED);
+    s->result = snapshot_save(s->snap, s->filename, s->mode, &s->written);
+    s->error = errno;
+    s->elapsed_ns = now_ns() - start;
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    event_loop_wake();
+    return NULL;
+}
+
+void editor_save() {
+    if (E.save) {
+        editor_set_status_message("Still saving the last changes");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editor_set_status_message("Save aborted!");
+            return;
+        }
+        editor_select_syntax_highlight();
+    }
+
+    // the file is replaced rather than rewritten, so rows may go on
+    // borrowing from the mapping of the old one
+    struct save_job *s = calloc(1, sizeof(struct save_job));
+    s->snap = editor_snapshot_take();
+    s->filename = strdup(E.filename);
+    s->mode = new_file_mode();  // here, as the umask is process-wide
+    s->dirty = E.dirty;
+    if (pthread_create(&s->thread, NULL, save_thread, s) != 0) {
+        save_thread(s);
+        s->joined = 1;
+    }
+    E.save = s;
+}
+
+/**
+ * Report on the save once the worker has finished it. Edits made while it
+ * ran are left counted in `E.dirty`. Returns whether there is something new
+ * to show, which includes progress.
+ */
+int editor_save_poll() {
+    struct save_job *s = E.save;
+    if (s == NULL) {
+        return 0;
+    }
+    if (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) {
+        long long written = __atomic_load_n(&s->written, __ATOMIC_RELAXED);
+        if (written == s->shown) {
+            return 0;
+        }
+        s->shown = written;
+        return 1;
+    }
+    if (!s->joined) {
+        pthread_join(s->thread, NULL);
+    }
+    if (s->result == -1) {
+        editor_set_status_message("Cannot save! I/O error: %s",
+                                  strerror(s->error));
+    } else {
+        E.dirty -= s->dirty;
+        if (s->written < 1048576) {
+            editor_set_status_message("%lld bytes written to disk",
+                                      s->written);
+        } else {
+            editor_set_status_message(
+                "%lld bytes written to disk (%.0f MB/s)", s->written,
+                s->written / 1048576.0 / (s->elapsed_ns / 1e9));
+        }
+    }
+    editor_snapshot_release(s->snap);
+    free(s->filename);
+    free(s);
+    E.save = NULL;
+    return 1;
+}
+
+/**
+ * Wait for a running save to finish, e.g. before quitting
+ */
+void editor_save_wait() {
+    struct save_job *s = E.save;
+    if (s == NULL) {
+        return;
+    }
+    if (!s->joined) {
+        pthread_join(s->thread, NULL);
+        s->joined = 1;
+    }
+    editor_save_poll();
+}
+
+/**
+ * "saving 42%" for the status bar while a save runs
+ */
+int editor_save_status(char *buf, int size) {
+    struct save_job *s = E.save;
+    if (s == NULL) {
+        return 0;
+    }
+    long long total = __atomic_load_n(&s->total, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return snprintf(buf, size, "saving | ");
+    }
+    long long written = __atomic_load_n(&s->written, __ATOMIC_RELAXED);
+    return snprintf(buf, size, "saving %d%% | ", (int)(written * 100 / total));
+}
+
+/*** find ***/
+
+// rewritten whenever the search options change or the pattern is bad
+char find_prompt[192];
+
+void editor_find_set_prompt();
 
-        if (prev_sep) {
-            // keywords require a separator both _before_ and _after_
-            int j;
-            for (j = 0; reserveds[j]; j++) {
-                int len = strlen(reserveds[j]);
-                int reserved_type = reserveds[j][len - 1] == '|';
-                if (reserved_type) len--;
+/**
+ * The search in progress. Each query makes one pass over the rows from the
+ * top, a slice at a time between keypresses, and collects every row that
+ * matches. A query that extends the one before it can only match rows the
+ * earlier query matched, so its pass checks just those.
+ */
+struct find_state {
+    char *query;  // NULL when not searching
+    struct search_needle needle;
+    const char *error;  // why the query is not a valid regex, if it is not
+    int next_row;  // rows above this one have been checked
+    int done;      // all rows have been checked
+    int *matches;  // rows that match, in order
+    int n_matches;
+    int cap_matches;
+    // rows above `narrow_limit` need checking only if listed in `narrow`
+    int *narrow;
+    int n_narrow;
+    int narrow_next;  // first entry of `narrow` not passed yet
+    int narrow_limit;
+    int current;  // the match the cursor is on, or -1
+    // move to the first match below (1) or the last one above (-1) row
+    // `want_from` once the pass finds it; 0 if not waiting for one
+    int want;
+    int want_from;
+    int moved;  // the cursor moved since the screen was last refreshed
+    // rows the trigram index says may match, if there is an index
+    uint64_t *groups;
+    uint32_t groups_limit;
+    struct find_count *count;
+};
 
-                if (!strncmp(&row->render[i], reserveds[j], len) &&
-                    is_separator(row->render[i + len])) {
-                    memset(
-                        &row->hl[i],
-                        reserved_type ? HL_RESERVED_TYPE : HL_RESERVED_KEYWORD,
-                        len);
-                    i += len;
-                    break;
-                }
-            }
+struct find_state F;
 
-            // check if the previous for loop is broken out
-            if (reserveds[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
-        }
+void editor_find_set_prompt() {
+    snprintf(find_prompt, sizeof(find_prompt),
+             "Search%s%s%s%s%s: %%s (<Enter> search | <ESC> cancel | "
+             "← ↑ backward | → ↓ forward | Ctrl-T case | Ctrl-E regex)",
+             E.find_regex ? " regex" : "",
+             E.find_ignore_case ? " (ignoring case)" : "",
+             F.error ? " [" : "", F.error ? F.error : "", F.error ? "]" : "");
+}
 
-        prev_sep = is_separator(c);
-        i++;
+/**
+ * Prepare a needle for `query` with the search options as they are set.
+ * Returns why the query is not a valid regex, or NULL.
+ */
+const char *editor_find_needle(struct search_needle *n, const char *query) {
+    const char *error = NULL;
+    if (E.find_regex && query[0]) {
+        search_needle_init_regex(n, query, E.find_ignore_case, &error);
+    } else {
+        search_needle_init(n, query, E.find_ignore_case);
     }
+    return error;
+}
 
-    // whether the row ended as an unclosed multiline comment or not
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->row_idx + 1 < E.num_rows) {
-        editor_update_syntax(&E.rows[row->row_idx + 1]);
+/**
+ * How many matches the search has, counted on a worker thread over a
+ * snapshot so that it can take its time. Only `cancel` and `done` are
+ * touched by both threads.
+ */
+struct find_count {
+    struct snapshot *snap;
+    struct search_needle needle;
+    uint64_t *groups;  // a copy of `F.groups`
+    uint32_t groups_limit;
+    int cancel;  // set by the main thread to stop the worker early
+    int done;    // set by the worker when it is finished
+    int joined;  // the main thread has waited for the worker
+    long total;
+    // rows with matches, and how many matches come before each of them
+    int *rows;
+    long *before;
+    int n_rows;
+    int cap_rows;
+    pthread_t thread;
+};
+
+void *find_count_thread(void *arg) {
+    struct find_count *c = arg;
+    for (int j = 0; j < c->snap->num_rows; j++) {
+        if ((j & 1023) == 0 && __atomic_load_n(&c->cancel, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (!index_candidate(c->groups, c->groups_limit, c->snap->rows[j].id)) {
+            continue;
+        }
+        const char *chars = c->snap->rows[j].chars;
+        int size = c->snap->rows[j].size;
+        if (!search_any(chars, size, &c->needle)) {
+            continue;
+        }
+        int in_row = 0;
+        int at = 0, found, end;
+        while ((found = search_match(chars, size, at, &c->needle, &end)) !=
+               -1) {
+            in_row++;
+            // an empty match is passed over rather than found again
+            at = end > found ? end : found + 1;
+        }
+        if (c->n_rows == c->cap_rows) {
+            c->cap_rows = c->cap_rows ? c->cap_rows * 2 : 64;
+            c->rows = realloc(c->rows, sizeof(int) * c->cap_rows);
+            c->before = realloc(c->before, sizeof(long) * c->cap_rows);
+        }
+        c->rows[c->n_rows] = j;
+        c->before[c->n_rows] = c->total;
+        c->n_rows++;
+        c->total += in_row;
     }
+    __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    event_loop_wake();
+    return NULL;
 }
 
-int editor_syntax_to_color(int hl) {
-    switch (hl) {
-        case HL_ML_COMMENT:
-        case HL_COMMENT:
-            return 36;  // cyan
-        case HL_RESERVED_KEYWORD:
-            return 33;  // yellow
-        case HL_RESERVED_TYPE:
-            return 32;  // green
-        case HL_STRING:
-            return 35;  // magenta
-        case HL_NUMBER:
-            // 31 is the red foreground color
-            // https://en.wikipedia.org/wiki/ANSI_escape_code#3-bit_and_4-bit
-            return 31;
-        case HL_MATCH:
-            return 34;
-        default:
-            // 39 is the white foreground color
-            return 37;
+/**
+ * Wait for the worker to stop, and free the count
+ */
+void editor_find_count_free(struct find_count *c) {
+    if (c == NULL) {
+        return;
+    }
+    if (!c->joined) {
+        __atomic_store_n(&c->cancel, 1, __ATOMIC_RELAXED);
+        pthread_join(c->thread, NULL);
     }
+    editor_snapshot_release(c->snap);
+    search_needle_free(&c->needle);
+    free(c->groups);
+    free(c->rows);
+    free(c->before);
+    free(c);
 }
 
 /**
- * Tries to match the current filename to one of the `filematch` fields
- * in HLDB
+ * Count the matches of the search shown in the text as it is now
  */
-void editor_select_syntax_highlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) {
+void editor_find_count_start() {
+    editor_find_count_free(F.count);
+    F.count = NULL;
+    if (search_needle_empty(&F.needle)) {
         return;
     }
-
-    char *ext = strchr(E.filename, '.');  // first occurrence
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editor_syntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
-
-                int row;
-                for (row = 0; row < E.num_rows; row++) {
-                    editor_update_syntax(&E.rows[row]);
-                }
-                return;
-            }
-            i++;
-        }
+    struct find_count *c = calloc(1, sizeof(struct find_count));
+    c->snap = editor_snapshot_take();
+    // a regex keeps scratch space, so the worker needs its own
+    editor_find_needle(&c->needle, F.query);
+    if (F.groups) {
+        size_t words = index_groups_words(F.groups_limit);
+        c->groups = malloc(sizeof(uint64_t) * words);
+        memcpy(c->groups, F.groups, sizeof(uint64_t) * words);
+        c->groups_limit = F.groups_limit;
+    }
+    if (pthread_create(&c->thread, NULL, find_count_thread, c) != 0) {
+        find_count_thread(c);
+        c->joined = 1;
     }
+    F.count = c;
 }
 
-/*** row operations ***/
-
 /**
- * Convert a `chars` index into a `render` index
+ * Pick up the count once the worker has finished, and start over when the
+ * text changed since. Returns whether there is something new to show.
  */
-int editor_row_cx_to_rx(struct editor_row *row, int cx) {
-    // loop through all characters to the left of `cx`
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        }
-        rx++;
+int editor_find_count_poll() {
+    struct find_count *c = F.count;
+    if (F.query == NULL || c == NULL) {
+        return 0;
     }
-    return rx;
+    if (!c->joined && __atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) {
+        pthread_join(c->thread, NULL);
+        c->joined = 1;
+        return 1;
+    }
+    if (c->joined && c->snap->version != E.version &&
+        now_ns() >= editor_find_count_due()) {
+        editor_find_count_start();
+    }
+    return 0;
 }
 
 /**
- * Convert a `render` index into a `chars` index
+ * When the count of a search that the text changed under is started over:
+ * once typing has paused, so that a burst of edits does not take a snapshot
+ * each. 0 if no count is waiting for that.
  */
-int editor_row_rx_to_cx(struct editor_row *row, int rx) {
-    int curr_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            curr_rx += (KILO_TAB_STOP - 1) - (curr_rx % KILO_TAB_STOP);
-        }
-        curr_rx++;
-        if (curr_rx > rx) {
-            return cx;
-        }
+uint64_t editor_find_count_due() {
+    struct find_count *c = F.count;
+    if (F.query == NULL || c == NULL || !c->joined ||
+        c->snap->version == E.version) {
+        return 0;
     }
-
-    return cx;
+    return E.edited_ns + KILO_RECOUNT_MS * 1000000ULL;
 }
 
-void editor_update_row(struct editor_row *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
+/**
+ * "match k of N" for the status bar, if the cursor is on a match and the
+ * count is up to date; "N matches" if it is not on one
+ */
+int editor_find_count_status(char *buf, int size) {
+    struct find_count *c = F.count;
+    if (F.query == NULL || c == NULL) {
+        return 0;
+    }
+    if (!c->joined || c->snap->version != E.version) {
+        return snprintf(buf, size, "counting | ");
     }
-    free(row->render);
-    // each tab is 8 chars; initial row->size already has one char for each tab
-    // including '\0'
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';  // advance the cursor at least one space
-            while (idx % KILO_TAB_STOP != 0) {
-                // until running into tabstop
-                row->render[idx++] = ' ';
-            }
+    int lo = 0, hi = c->n_rows;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c->rows[mid] < E.cy) {
+            lo = mid + 1;
         } else {
-            row->render[idx++] = row->chars[j];
+            hi = mid;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editor_update_syntax(row);
+    if (lo < c->n_rows && c->rows[lo] == E.cy) {
+        struct editor_row *row = editor_row_at(E.cy);
+        long k = c->before[lo];
+        int at = 0, found, end;
+        while ((found = search_match(row->chars, row->size, at, &F.needle,
+                                     &end)) != -1 &&
+               found <= E.cx) {
+            k++;
+            if (found == E.cx) {
+                return snprintf(buf, size, "match %ld of %ld | ", k,
+                                c->total);
+            }
+            at = end > found ? end : found + 1;
+        }
+    }
+    return snprintf(buf, size, "%ld matches | ", c->total);
 }
 
-void editor_insert_row(int at_row, char *s, size_t len) {
-    if (at_row < 0 || at_row > E.num_rows) {
-        return;
+/**
+ * `row->hl` with every match of the search shown painted over it, in a
+ * buffer reused from row to row; just `row->hl` if there are none
+ */
+unsigned char *editor_find_paint(struct editor_row *row) {
+    static unsigned char *hl = NULL;
+    static int hl_cap = 0;
+    if (F.query == NULL) {
+        return row->hl;
     }
-    E.rows = realloc(E.rows, sizeof(struct editor_row) * (E.num_rows + 1));
-    memmove(&E.rows[at_row + 1], &E.rows[at_row],
-            sizeof(struct editor_row) * (E.num_rows - at_row));
+    int end;
+    int at = search_match(row->chars, row->size, 0, &F.needle, &end);
+    if (at == -1) {
+        return row->hl;
+    }
+    if (row->rsize > hl_cap) {
+        hl_cap = row->rsize;
+        hl = realloc(hl, hl_cap);
+    }
+    memcpy(hl, row->hl, row->rsize);
+    while (at != -1) {
+        int rx = editor_row_cx_to_rx(row, at);
+        memset(&hl[rx], HL_MATCH, editor_row_cx_to_rx(row, end) - rx);
+        at = search_match(row->chars, row->size, end > at ? end : at + 1,
+                          &F.needle, &end);
+    }
+    return hl;
+}
 
-    E.rows[at_row].row_idx = at_row;
-    E.rows[at_row].size = len;
-    E.rows[at_row].chars = malloc(len + 1);
-    memcpy(E.rows[at_row].chars, s, len);
-    E.rows[at_row].chars[len] = '\0';
+/**
+ * Stop the pass, keeping the search shown
+ */
+void editor_find_finish() {
+    free(F.matches);
+    free(F.narrow);
+    F.matches = F.narrow = NULL;
+    F.n_matches = F.cap_matches = F.n_narrow = 0;
+    F.done = 1;
+    F.current = -1;
+    F.want = 0;
+}
 
-    E.rows[at_row].rsize = 0;
-    E.rows[at_row].render = NULL;
-    E.rows[at_row].hl = NULL;
-    E.rows[at_row].hl_open_comment = 0;
+/**
+ * Stop searching and stop showing the matches
+ */
+void editor_find_reset() {
+    editor_find_count_free(F.count);
+    free(F.query);
+    search_needle_free(&F.needle);
+    free(F.groups);
+    free(F.matches);
+    free(F.narrow);
+    memset(&F, 0, sizeof(F));
+    F.current = -1;
+}
 
-    editor_update_row(&E.rows[at_row]);
+/**
+ * Start a pass for `query`, dropping the one in progress. The cursor moves to
+ * the first match below row `from`.
+ */
+void editor_find_start(char *query, int from) {
+    struct search_needle needle;
+    const char *error = editor_find_needle(&needle, query);
+
+    // matches of the previous query, if the new one extends it; a pattern
+    // that extends another can match rows the other did not
+    int *narrow = NULL, n_narrow = 0, narrow_limit = 0;
+    if (F.query && F.needle.len > 0 && !F.needle.re && !needle.re &&
+        F.needle.ignore_case == needle.ignore_case &&
+        strstr(needle.s, F.needle.s)) {
+        narrow = F.matches;
+        n_narrow = F.n_matches;
+        narrow_limit = F.done ? E.num_rows : F.next_row;
+        F.matches = NULL;
+    }
 
-    E.num_rows++;
-    E.dirty++;
+    editor_find_reset();
+    F.query = strdup(query);
+    F.needle = needle;
+    F.error = error;
+    F.narrow = narrow;
+    F.n_narrow = n_narrow;
+    F.narrow_limit = narrow_limit;
+    F.want = 1;
+    F.want_from = from;
+    F.groups = editor_index_candidates(&F.needle, &F.groups_limit);
+    editor_find_count_start();
+    editor_find_set_prompt();
 }
 
-void editor_free_row(struct editor_row *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+/**
+ * Put the cursor on the first match in `row`
+ */
+void editor_find_jump(int row_idx) {
+    struct editor_row *row = editor_row_at(row_idx);
+    int end;
+    int match = search_match(row->chars, row->size, 0, &F.needle, &end);
+    F.current = row_idx;
+    F.want = 0;
+    F.moved = 1;
+    E.cy = row_idx;
+    E.cx = match;
+    // scroll to bottom of the screen, so that on next refresh
+    // the matching line will be at top of the screen
+    E.rowoff = E.num_rows;
 }
 
-void editor_del_row(int at) {
-    if (at < 0 || at >= E.num_rows) {
-        return;
+/**
+ * Continue the pass until it is done or `deadline` (if not 0) has passed
+ */
+void editor_find_run(uint64_t deadline) {
+    int checked = 0;
+    while (F.query && !F.done) {
+        // reading the clock costs more than checking a short row
+        if (deadline && (++checked & 63) == 0 && now_ns() > deadline) {
+            return;
+        }
+        int row_idx = F.next_row;
+        if (row_idx < F.narrow_limit) {
+            while (F.narrow_next < F.n_narrow &&
+                   F.narrow[F.narrow_next] < row_idx) {
+                F.narrow_next++;
+            }
+            row_idx = F.narrow_next < F.n_narrow ? F.narrow[F.narrow_next]
+                                                 : F.narrow_limit;
+            if (row_idx > F.narrow_limit) row_idx = F.narrow_limit;
+        }
+        if (row_idx >= E.num_rows) {
+            F.done = 1;
+            break;
+        }
+        F.next_row = row_idx + 1;
+
+        struct editor_row *row = editor_row_at(row_idx);
+        if (!index_candidate(F.groups, F.groups_limit, row->id) ||
+            !search_any(row->chars, row->size, &F.needle)) {
+            continue;
+        }
+        if (F.n_matches == F.cap_matches) {
+            F.cap_matches = F.cap_matches ? F.cap_matches * 2 : 64;
+            F.matches = realloc(F.matches, sizeof(int) * F.cap_matches);
+        }
+        F.matches[F.n_matches++] = row_idx;
+        if (F.want == 1 && row_idx > F.want_from) {
+            editor_find_jump(row_idx);
+        }
     }
 
-    editor_free_row(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1],
-            sizeof(struct editor_row) * (E.num_rows - at - 1));
-    for (int j = at; j < E.num_rows - 1; j++) {
-        E.rows[j].row_idx--;
+    if (F.done && F.want && F.n_matches) {
+        // nothing in that direction; wrap around
+        editor_find_jump(F.want == 1 ? F.matches[0]
+                                     : F.matches[F.n_matches - 1]);
     }
-    E.num_rows--;
-    E.dirty++;
 }
 
-void editor_row_insert_char(struct editor_row *row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;  // by default append the char
+/**
+ * Move to the next match in `direction`, or wait for the pass to find it
+ */
+void editor_find_move(int direction) {
+    if (F.current == -1) {
+        return;  // still looking for the first match
+    }
+    // the first match below the current one, if found yet
+    int lo = 0, hi = F.n_matches;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (F.matches[mid] <= F.current) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // the current match is at lo - 1; every row above it has been checked
+    if (direction == 1 && lo < F.n_matches) {
+        editor_find_jump(F.matches[lo]);
+    } else if (direction == -1 && lo >= 2) {
+        editor_find_jump(F.matches[lo - 2]);
+    } else {
+        F.want = direction;
+        F.want_from = F.current;
     }
-    // add 2 bytes - making room for the null byte
-    // because the memmove below _shifts_ the existing sub line to the right
-    // 1 byte;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
 }
 
-void editor_row_append_string(struct editor_row *row, char *s, size_t len) {
-    // size does not include null byte
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
-}
+int editor_find_pending() { return F.query && !F.done; }
 
-void editor_row_del_char(struct editor_row *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+/**
+ * Advance the search for one time slice
+ */
+void editor_find_step() {
+    editor_find_run(now_ns() + KILO_HL_BUDGET_MS * 1000000ULL);
+    if (F.moved) {
+        F.moved = 0;
+        editor_refresh_screen();
+    }
 }
 
-/*** editor operations ***/
-
-void editor_insert_char(int c) {
-    if (E.cy == E.num_rows) {
-        editor_insert_row(E.num_rows, "", 0);
+void editor_find_callback(char *query, int key) {
+    if (key == '\r') {
+        // keep showing the matches until <Esc>
+        editor_find_finish();
+        return;
+    } else if (key == '\x1b') {
+        editor_find_reset();
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        editor_find_move(1);
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        editor_find_move(-1);
+    } else if (key == CTRL_KEY('t') || key == CTRL_KEY('e')) {
+        if (key == CTRL_KEY('t')) {
+            E.find_ignore_case = !E.find_ignore_case;
+        } else {
+            E.find_regex = !E.find_regex;
+        }
+        // look again from the current match, which may no longer be one
+        int from = F.current == -1 ? -1 : F.current - 1;
+        editor_find_start(query, from);
+    } else if (F.query == NULL || strcmp(query, F.query)) {
+        // a new query cancels the search for the old one
+        editor_find_start(query, -1);
     }
-    editor_row_insert_char(&E.rows[E.cy], E.cx, c);
-    E.cx++;
+    editor_find_run(now_ns() + KILO_HL_BUDGET_MS * 1000000ULL);
+    F.moved = 0;  // the prompt refreshes the screen next
 }
 
-void editor_insert_new_line() {
-    if (E.cx == 0) {
-        // add a new empty line _BEFORE_ the current line
-        editor_insert_row(E.cy, "", 0);
+void editor_find() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    editor_find_reset();
+    editor_find_set_prompt();
+    char *query = editor_prompt(find_prompt, editor_find_callback);
+
+    if (query) {
+        free(query);
     } else {
-        struct editor_row *row = &E.rows[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        // need to reassign the row pointer since `editor_inser_row()` calls
-        // `realloc()` which may have invalidated the pointer
-        row = &E.rows[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
     }
+}
 
-    E.cy++;
-    E.cx = 0;
+/**
+ * Replace every match of `n` in the buffer with `with`. Each changed row is
+ * rebuilt in one allocation, and the comment states below are brought up to
+ * date once all rows have changed rather than after each. Returns the
+ * number of matches replaced.
+ */
+long editor_replace_all(struct search_needle *n, const char *with,
+                        int *rows_changed) {
+    int with_len = strlen(with);
+    uint32_t limit = 0;
+    uint64_t *groups = editor_index_candidates(n, &limit);
+    int *changed = NULL;
+    int n_changed = 0, cap_changed = 0;
+    long total = 0;
+    for (int j = 0; j < E.num_rows; j++) {
+        struct editor_row *row = editor_row_at(j);
+        if (!index_candidate(groups, limit, row->id) ||
+            !search_any(row->chars, row->size, n)) {
+            continue;
+        }
+        // measure, then build the new text in one go
+        int size = row->size, at = 0, found, end;
+        long in_row = 0;
+        while ((found = search_match(row->chars, row->size, at, n, &end)) !=
+               -1) {
+            size += with_len - (end - found);
+            in_row++;
+            at = end > found ? end : found + 1;
+        }
+        char *chars = malloc(size + 1);
+        int len = 0;
+        at = 0;
+        while ((found = search_match(row->chars, row->size, at, n, &end)) !=
+               -1) {
+            memcpy(&chars[len], &row->chars[at], found - at);
+            len += found - at;
+            memcpy(&chars[len], with, with_len);
+            len += with_len;
+            if (end == found) {
+                // an empty match: keep the byte after it and move on
+                if (found < row->size) chars[len++] = row->chars[found];
+                end = found + 1;
+            }
+            at = end;
+        }
+        if (at < row->size) {
+            memcpy(&chars[len], &row->chars[at], row->size - at);
+        }
+        chars[size] = '\0';
+        editor_row_release_chars(row);
+        row->chars = chars;
+        row->size = size;
+        editor_row_invalidate(row);
+        total += in_row;
+
+        if (n_changed == cap_changed) {
+            cap_changed = cap_changed ? cap_changed * 2 : 64;
+            changed = realloc(changed, sizeof(int) * cap_changed);
+        }
+        changed[n_changed++] = j;
+    }
+    // a rescan running into a changed row carries on through it, so each
+    // changed row is scanned once
+    for (int k = 0; k < n_changed; k++) {
+        if (changed[k] < E.hl_horizon) {
+            editor_hl_propagate(changed[k]);
+        }
+    }
+    if (n_changed) {
+        editor_mark_dirty();
+    }
+    free(changed);
+    free(groups);
+    *rows_changed = n_changed;
+    return total;
 }
 
-void editor_del_char() {
-    if (E.cy == E.num_rows) {
+/**
+ * Ask for what to replace, as a regex or ignoring case if searches are set
+ * to, and what with
+ */
+void editor_replace() {
+    char *query = editor_prompt("Replace: %s (ESC to cancel)", NULL);
+    if (query == NULL) {
         return;
     }
-    if (E.cx == 0 && E.cy == 0) {
+    char *with = editor_prompt("Replace with: %s (ESC to cancel)", NULL);
+    if (with == NULL) {
+        free(query);
         return;
     }
-
-    struct editor_row *row = &E.rows[E.cy];
-    if (E.cx > 0) {
-        editor_row_del_char(row, E.cx - 1);  // delete char before the cursor
-        E.cx--;
+    editor_find_reset();  // the matches shown are about to change
+    struct search_needle needle;
+    const char *error = editor_find_needle(&needle, query);
+    if (error) {
+        editor_set_status_message("Bad regex: %s", error);
     } else {
-        E.cx = E.rows[E.cy - 1].size;
-        editor_row_append_string(&E.rows[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+        uint64_t start = now_ns();
+        int rows;
+        long total = editor_replace_all(&needle, with, &rows);
+        editor_set_status_message("Replaced %ld matches on %d lines (%.0f ms)",
+                                  total, rows, (now_ns() - start) / 1e6);
+        if (E.cy < E.num_rows && E.cx > editor_row_at(E.cy)->size) {
+            E.cx = editor_row_at(E.cy)->size;
+        }
     }
+    search_needle_free(&needle);
+    free(query);
+    free(with);
 }
 
-/*** file I/O ***/
+/*** append buffer ***/
 
 /**
- * Convert the array of `struct editor_row`s into a single string
+ * append buffer; its capacity doubles as it fills, so a buffer that is
+ * emptied and reused soon stops reallocating at all
  */
-char *editor_rows_to_string(int *buf_len) {
-    int total_len = 0;
-    int j;
-    for (j = 0; j < E.num_rows; j++) {
-        total_len += E.rows[j].size + 1;  // including the newline
+struct abuf {
+    char *buffer;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT \
+    { NULL, 0, 0 }
+
+void abuf_append(struct abuf *ab, const char *s, int len) {
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 1024;
+        while (cap < ab->len + len) {
+            cap *= 2;
+        }
+        // realloc either extend the size of the current block of memory
+        // or _frees_ the current block of memory and allocates new block
+        char *new = realloc(ab->buffer, cap);
+        if (!new) return;
+        ab->buffer = new;
+        ab->cap = cap;
     }
-    *buf_len = total_len;
+    memcpy(&ab->buffer[ab->len], s, len);
+    ab->len += len;
+}
 
-    char *buf = malloc(total_len);
-    char *p = buf;
-    for (j = 0; j < E.num_rows; j++) {
-        memcpy(p, E.rows[j].chars, E.rows[j].size);
-        p += E.rows[j].size;
-        *p = '\n';
-        p++;
+void abuf_free(struct abuf *ab) { free(ab->buffer); }
+
+/*** frame buffer ***/
+
+/**
+ * The screen is drawn into a frame of cells, which is compared with a shadow
+ * frame of what the terminal already shows; only the cells that differ are
+ * written, with the shortest cursor movement and SGR changes that get there.
+ */
+
+// unchanged cells up to this many between two changed ones are written again
+// rather than moved over, which takes at least as many bytes
+#define FRAME_GAP 3
+
+void frame_resize(struct frame *f, int rows, int cols) {
+    f->rows = rows;
+    f->cols = cols;
+    // only ever grown, so that dragging the terminal's size about does not
+    // reallocate at every step
+    if (rows * cols > f->cap_cells) {
+        f->cap_cells = rows * cols;
+        f->chars = realloc(f->chars, f->cap_cells);
+        f->styles = realloc(f->styles, f->cap_cells);
     }
+    if (rows > f->cap_rows) {
+        f->cap_rows = rows;
+        f->wide = realloc(f->wide, f->cap_rows);
+    }
+}
 
-    return buf;
+void frame_clear(struct frame *f) {
+    memset(f->chars, ' ', f->rows * f->cols);
+    memset(f->styles, STYLE_DEFAULT, f->rows * f->cols);
+    memset(f->wide, 0, f->rows);
 }
 
-void editor_open(char *filename) {
-    free(E.filename);
-    // assuming you will free this memory yourself
-    E.filename = strdup(filename);
+/**
+ * Write `len` bytes at row `y` from column `x`, clipped to the frame.
+ * Returns the column after them.
+ */
+int frame_puts(struct frame *f, int y, int x, const char *s, int len,
+               int style) {
+    if (len > f->cols - x) {
+        len = f->cols - x;
+    }
+    memcpy(&f->chars[y * f->cols + x], s, len);
+    memset(&f->styles[y * f->cols + x], style, len);
+    for (int j = 0; j < len; j++) {
+        if ((unsigned char)s[j] >= 0x80) {
+            f->wide[y] = 1;
+        }
+    }
+    return x + len;
+}
 
-    // detect filetype after filename changes
-    editor_select_syntax_highlight();
+/**
+ * Whether cell `i` of `a` and cell `j` of `b` look the same
+ */
+int frame_same(struct frame *a, int i, struct frame *b, int j) {
+    return a->chars[i] == b->chars[j] && a->styles[i] == b->styles[j];
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
+/**
+ * The SGR sequence from each style, or from an unknown one (the last row), to
+ * each other, and the style each highlight class is drawn in; built once at
+ * startup
+ */
+char sgr_table[STYLE_COUNT + 1][STYLE_COUNT][16];
+unsigned char sgr_table_len[STYLE_COUNT + 1][STYLE_COUNT];
+unsigned char hl_style[256];
+
+void sgr_table_init() {
+    for (int hl = 0; hl < 256; hl++) {
+        hl_style[hl] = hl == HL_NORMAL ? STYLE_DEFAULT
+                                       : editor_syntax_to_color(hl) - 29;
     }
-    char *line = NULL;
-    size_t line_cap = 0;  // line capacity
-    // ssize_t - signed size_t; can store at least -1 to 2^15 - 1
-    ssize_t line_len;  // excluding '\0'
-    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-        while (line_len > 0 &&
-               (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-            line_len--;  // strips off the newline
+    for (int from = 0; from <= STYLE_COUNT; from++) {
+        for (int to = 0; to < STYLE_COUNT; to++) {
+            char *buf = sgr_table[from][to];
+            int len;
+            if (from == to) {
+                len = 0;
+            } else if (to == STYLE_DEFAULT) {
+                len = snprintf(buf, 16, "\x1b[m");
+            } else {
+                // from an unknown style, reset everything first
+                int was = from == STYLE_COUNT ? STYLE_DEFAULT : from;
+                len = snprintf(buf, 16, "\x1b[%s",
+                               from == STYLE_COUNT ? "0;" : "");
+                if ((was >= STYLE_INVERSE) != (to >= STYLE_INVERSE)) {
+                    len += snprintf(&buf[len], 16 - len, "%s;",
+                                    to >= STYLE_INVERSE ? "7" : "27");
+                }
+                int was_color = was % STYLE_INVERSE, color = to % STYLE_INVERSE;
+                if (was_color != color) {
+                    len += snprintf(&buf[len], 16 - len, "%d;",
+                                    color ? 29 + color : 39);
+                }
+                buf[len - 1] = 'm';
+            }
+            sgr_table_len[from][to] = len;
         }
-        editor_insert_row(E.num_rows, line, line_len);
     }
+}
 
-    if (line) free(line);
-    fclose(fp);
-    E.dirty = 0;
+void frame_set_style(struct abuf *ab, struct frame_pen *pen, int style) {
+    if (pen->style == style) {
+        return;
+    }
+    int from = pen->style == -1 ? STYLE_COUNT : pen->style;
+    abuf_append(ab, sgr_table[from][style], sgr_table_len[from][style]);
+    pen->style = style;
 }
 
-void editor_save() {
-    if (E.filename == NULL) {
-        E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editor_set_status_message("Save aborted!");
-            return;
+/**
+ * Move the cursor to row `y`, column `x`, the shortest way there
+ */
+void frame_move(struct abuf *ab, struct frame_pen *pen, int y, int x) {
+    if (pen->y == y && pen->x == x) {
+        return;
+    }
+    char best[32], buf[32];
+    int best_len = snprintf(best, sizeof(best), "\x1b[%d;%dH", y + 1, x + 1);
+    int len = -1;
+    if (pen->y == y && x == 0) {
+        len = snprintf(buf, sizeof(buf), "\r");
+    } else if (pen->y == y && pen->x != -1) {
+        len = snprintf(buf, sizeof(buf), "\x1b[%d%c", abs(x - pen->x),
+                       x > pen->x ? 'C' : 'D');
+    } else if (pen->y != -1 && pen->y + 1 == y) {
+        // raw mode: a line feed keeps the column
+        if (pen->x == x) {
+            len = snprintf(buf, sizeof(buf), "\n");
+        } else if (x == 0) {
+            len = snprintf(buf, sizeof(buf), "\r\n");
+        } else if (pen->x != -1) {
+            len = snprintf(buf, sizeof(buf), "\n\x1b[%d%c", abs(x - pen->x),
+                           x > pen->x ? 'C' : 'D');
         }
-        editor_select_syntax_highlight();
     }
+    if (len != -1 && len < best_len) {
+        abuf_append(ab, buf, len);
+    } else {
+        abuf_append(ab, best, best_len);
+    }
+    pen->y = y;
+    pen->x = x;
+}
 
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        // <unistd.h>
-        // cut off any additional data
-        // add `0` bytes to reach the length if short
-        if (ftruncate(fd, len) != -1) {
-            // safer to write data to a file than passing `O_TRUNC`
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editor_set_status_message("%d bytes written to disk", len);
-                return;
-            }
+/**
+ * Write the cells of row `y` from column `from` up to `to`, at the cursor
+ */
+void frame_emit(struct abuf *ab, struct frame_pen *pen, struct frame *f,
+                int y, int from, int to) {
+    const char *chars = &f->chars[y * f->cols];
+    const unsigned char *styles = &f->styles[y * f->cols];
+    // one style change and one copy per run of cells in the same style
+    for (int x = from, run; x < to; x = run) {
+        for (run = x + 1; run < to && styles[run] == styles[x]; run++) {
         }
-        close(fd);
+        frame_set_style(ab, pen, styles[x]);
+        abuf_append(ab, &chars[x], run - x);
     }
+    // past the last column the cursor waits to wrap, which terminals do not
+    // all agree on
+    pen->x = to == f->cols ? -1 : to;
+}
 
-    free(buf);
-    editor_set_status_message("Cannot save! I/O error: %s", strerror(errno));
+void frame_erase_line(struct abuf *ab, struct frame_pen *pen) {
+    // erased cells take the current background, so go back to the default
+    frame_set_style(ab, pen, STYLE_DEFAULT);
+    abuf_append(ab, "\x1b[K", 3);
 }
 
-/*** find ***/
+/**
+ * Bring row `y` of the terminal from `was` to `now`
+ */
+void frame_diff_row(struct abuf *ab, struct frame_pen *pen, struct frame *now,
+                    struct frame *was, int y) {
+    int cols = now->cols, row = y * cols;
+    if (now->wide[y] == was->wide[y] &&
+        !memcmp(&now->chars[row], &was->chars[row], cols) &&
+        !memcmp(&now->styles[row], &was->styles[row], cols)) {
+        return;
+    }
+    // the blanks the row ends with are erased rather than written
+    int end = cols;
+    while (end > 0 && now->chars[row + end - 1] == ' ' &&
+           now->styles[row + end - 1] == STYLE_DEFAULT) {
+        end--;
+    }
 
-void editor_find_callback(char *query, int key) {
-    // these are row numbers
-    static int last_match = -1;
-    static int direction = 1;
-    static int saved_hl_line;      // which line's hl needs to be restored
-    static char *saved_hl = NULL;  // hl to be restored
-
-    if (saved_hl) {
-        memcpy(E.rows[saved_hl_line].hl, saved_hl, E.rows[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
-
-    if (key == '\r' || key == '\x1b') {
-        // if Enter or Esc
-        last_match = -1;
-        direction = 1;
+    if (now->wide[y] || was->wide[y]) {
+        // erased first: how many columns the row takes is up to the terminal
+        frame_move(ab, pen, y, 0);
+        frame_erase_line(ab, pen);
+        frame_emit(ab, pen, now, y, 0, end);
+        pen->x = -1;
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) {
-        direction = 1;  // search forward by default
-    }
-    int current = last_match;
-    int r;
-    for (r = 0; r < E.num_rows; r++) {
-        current += direction;  // forward or backward
-        if (current == -1) {
-            current = E.num_rows - 1;  // wrap around?
-        } else if (current == E.num_rows) {
-            current = 0;
-        }
-        struct editor_row *row = &E.rows[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editor_row_rx_to_cx(row, match - row->render);
-            // scroll to bottom of the screen, so that on next refresh
-            // the matching line will be at top of the screen
-            E.rowoff = E.num_rows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+    }
+
+    int x = 0;
+    while (x < cols) {
+        if (frame_same(now, row + x, was, row + x)) {
+            x++;
+            continue;
+        }
+        if (x >= end) {
+            frame_move(ab, pen, y, x);
+            frame_erase_line(ab, pen);
+            return;
+        }
+        // run on over unchanged cells too few to be worth moving over
+        int span_end = x + 1;
+        for (int k = x + 1, gap = 0; k < end && gap <= FRAME_GAP; k++) {
+            if (frame_same(now, row + k, was, row + k)) {
+                gap++;
+            } else {
+                span_end = k + 1;
+                gap = 0;
+            }
         }
+        frame_move(ab, pen, y, x);
+        frame_emit(ab, pen, now, y, x, span_end);
+        x = span_end;
     }
 }
 
-void editor_find() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-
-    char *prompt =
-        "Search: %s (<Enter> search | <ESC> cancel | ← ↑ backward | → ↓ "
-        "forward)";
-    char *query = editor_prompt(prompt, editor_find_callback);
+/**
+ * Move rows `top` to `bottom` of `f` up `n` rows (down if negative), blanking
+ * the rows that come in
+ */
+void frame_shift(struct frame *f, int top, int bottom, int n) {
+    int count = bottom - top + 1 - abs(n);
+    int from = n > 0 ? top + n : top;
+    int to = n > 0 ? top : top - n;
+    memmove(&f->chars[to * f->cols], &f->chars[from * f->cols],
+            count * f->cols);
+    memmove(&f->styles[to * f->cols], &f->styles[from * f->cols],
+            count * f->cols);
+    memmove(&f->wide[to], &f->wide[from], count);
+    int blank = n > 0 ? bottom - n + 1 : top;
+    memset(&f->chars[blank * f->cols], ' ', abs(n) * f->cols);
+    memset(&f->styles[blank * f->cols], STYLE_DEFAULT, abs(n) * f->cols);
+    memset(&f->wide[blank], 0, abs(n));
+}
 
-    if (query) {
-        free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+int frame_row_blank(struct frame *f, int y) {
+    for (int j = y * f->cols; j < (y + 1) * f->cols; j++) {
+        if (f->chars[j] != ' ' || f->styles[j] != STYLE_DEFAULT) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-/*** append buffer ***/
+/**
+ * How many rows from `top` to `bottom` of `now` would already be shown if
+ * `was` were shifted up `n` rows
+ */
+int frame_rows_same(struct frame *now, struct frame *was, int top, int bottom,
+                    int n) {
+    int same = 0, cols = now->cols;
+    for (int y = top; y <= bottom; y++) {
+        int from = y + n;
+        if (from < top || from > bottom) {
+            same += !now->wide[y] && frame_row_blank(now, y);
+        } else {
+            same += now->wide[y] == was->wide[from] &&
+                    !memcmp(&now->chars[y * cols], &was->chars[from * cols],
+                            cols) &&
+                    !memcmp(&now->styles[y * cols], &was->styles[from * cols],
+                            cols);
+        }
+    }
+    return same;
+}
 
 /**
- * append buffer
+ * The text moved up `n` rows on screen (down if negative) since the last
+ * refresh: have the terminal scroll the text rows by as much, so that only
+ * the rows that come in are drawn. Nothing is done unless that leaves fewer
+ * rows to redraw.
  */
-struct abuf {
-    char *buffer;
-    int len;
-};
+void editor_frame_scroll(struct abuf *ab, int n) {
+    int bottom = E.screen_rows - 1;
+    if (n == 0 || abs(n) > bottom ||
+        frame_rows_same(&E.frame, &E.shown, 0, bottom, n) <=
+            frame_rows_same(&E.frame, &E.shown, 0, bottom, 0)) {
+        return;
+    }
+    // rows scrolled in take the current background
+    frame_set_style(ab, &E.pen, STYLE_DEFAULT);
+    char buf[32];
+    // DECSTBM keeps the status and message bars out of the scroll, and homes
+    // the cursor, as does resetting it
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                       E.screen_rows, abs(n), n > 0 ? 'S' : 'T');
+    abuf_append(ab, buf, len);
+    frame_shift(&E.shown, 0, bottom, n);
+    E.pen.y = 0;
+    E.pen.x = 0;
+}
 
-#define ABUF_INIT \
-    { NULL, 0 }
+/**
+ * Append what turns the terminal's screen into `E.frame` to `ab`, ending
+ * with the cursor at row `cy`, column `cx`; `E.frame` then becomes what the
+ * terminal shows
+ */
+void editor_frame_flush(struct abuf *ab, int cy, int cx) {
+    if (E.shown.rows != E.frame.rows || E.shown.cols != E.frame.cols) {
+        frame_resize(&E.shown, E.frame.rows, E.frame.cols);
+        E.shown_valid = 0;
+    }
+    // hide the cursor while drawing
+    // https://vt100.net/docs/vt510-rm/DECTCEM.html
+    abuf_append(ab, "\x1b[?25l", 6);
+    int drawn_from = ab->len;
+    if (!E.shown_valid) {
+        abuf_append(ab, "\x1b[m\x1b[2J", 7);
+        frame_clear(&E.shown);
+        E.pen = (struct frame_pen){-1, -1, STYLE_DEFAULT};
+        E.shown_valid = 1;
+        E.shown_rowoff = E.rowoff;
+    }
+    if (E.rowoff != E.shown_rowoff) {
+        editor_frame_scroll(ab, E.rowoff - E.shown_rowoff);
+        E.shown_rowoff = E.rowoff;
+    }
+    for (int y = 0; y < E.frame.rows; y++) {
+        frame_diff_row(ab, &E.pen, &E.frame, &E.shown, y);
+    }
+    frame_set_style(ab, &E.pen, STYLE_DEFAULT);
+    int drawn = ab->len > drawn_from;
+    if (!drawn) {
+        ab->len -= 6;  // nothing to hide the cursor from
+    }
+    frame_move(ab, &E.pen, cy, cx);
+    if (drawn) {
+        abuf_append(ab, "\x1b[?25h", 6);
+    }
 
-void abuf_append(struct abuf *ab, const char *s, int len) {
-    // realloc either extend the size of the current block of memory
-    // or _frees_ the current block of memory and allocates new block
-    char *new = realloc(ab->buffer, ab->len + len);
-    if (!new) return;
-    memcpy(&new[ab->len], s, len);
-    ab->buffer = new;
-    ab->len += len;
+    struct frame swap = E.shown;
+    E.shown = E.frame;
+    E.frame = swap;
 }
 
-void abuf_free(struct abuf *ab) { free(ab->buffer); }
-
 /*** input ***/
 
 /**
@@ -950,6 +5791,23 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
                 }
                 return buf;
             }
+        } else if (c == PASTE_START) {
+            // its first line, taken as if typed; a line break in it does not
+            // submit the input
+            size_t len;
+            char *text = editor_read_paste(&len);
+            for (size_t j = 0; j < len && text[j] != '\n'; j++) {
+                if (iscntrl((unsigned char)text[j]) || text[j] & 0x80) {
+                    continue;
+                }
+                if (buf_len == buf_size - 1) {
+                    buf_size *= 2;
+                    buf = realloc(buf, buf_size);
+                }
+                buf[buf_len++] = text[j];
+            }
+            buf[buf_len] = '\0';
+            free(text);
         } else if (!iscntrl(c) && c < 128) {
             if (buf_len == buf_size - 1) {
                 buf_size *= 2;
@@ -968,7 +5826,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
  * Move cursors using J/H/K/L
  */
 void editor_move_cursor(int key) {
-    struct editor_row *curr_row = (E.cy >= E.num_rows) ? NULL : &E.rows[E.cy];
+    struct editor_row *curr_row = editor_row_at(E.cy);
 
     switch (key) {
         case ARROW_DOWN:
@@ -988,7 +5846,7 @@ void editor_move_cursor(int key) {
             } else if (E.cy > 0) {
                 // pressing <- allows user to move to the end of previous line
                 E.cy--;
-                E.cx = E.rows[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1003,7 +5861,7 @@ void editor_move_cursor(int key) {
     }
 
     // prevent cursor from moving pass the end of a line
-    curr_row = (E.cy >= E.num_rows) ? NULL : &E.rows[E.cy];
+    curr_row = editor_row_at(E.cy);
     int curr_row_len = curr_row ? curr_row->size : 0;
     if (E.cx > curr_row_len) {
         E.cx = curr_row_len;
@@ -1022,7 +5880,8 @@ void editor_process_keypress() {
             editor_insert_new_line();
             break;
         case CTRL_KEY('q'):
-            // enables <Ctrl-q> to quit
+            // enables <Ctrl-q> to quit, once a save under way is done
+            editor_save_wait();
             if (E.dirty && quit_times > 0) {
                 editor_set_status_message(
                     "WARNING!!! File has unsaved changes. Press Ctrl-Q %d more "
@@ -1049,12 +5908,15 @@ void editor_process_keypress() {
         case END_KEY:
             // move to the end of the line
             if (E.cy < E.num_rows) {
-                E.cx = E.rows[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             }
             break;
         case CTRL_KEY('f'):
             editor_find();
             break;
+        case CTRL_KEY('r'):
+            editor_replace();
+            break;
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1087,7 +5949,18 @@ void editor_process_keypress() {
             editor_move_cursor(c);
             break;
         case CTRL_KEY('l'):
+            E.shown_valid = 0;  // redraw the whole screen
+            break;
+        case PASTE_START: {
+            size_t len;
+            char *text = editor_read_paste(&len);
+            editor_insert_text(text, len);
+            free(text);
+        } break;
+        case PASTE_END:
+            break;
         case '\x1b':
+            editor_find_reset();  // stop showing the matches
             break;
         default:
             editor_insert_char(c);
@@ -1103,7 +5976,7 @@ void editor_process_keypress() {
 void editor_scroll() {
     E.rx = 0;
     if (E.cy < E.num_rows) {
-        E.rx = editor_row_cx_to_rx(&E.rows[E.cy], E.cx);
+        E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {
@@ -1127,7 +6000,9 @@ void editor_scroll() {
     }
 }
 
-void editor_draw_rows(struct abuf *ab) {
+void editor_draw_rows(struct frame *f) {
+    uint64_t deadline = now_ns() + KILO_HL_BUDGET_MS * 1000000ULL;
+    E.hl_guessed = 0;
     int y;
     for (y = 0; y < E.screen_rows; ++y) {
         int file_row = y + E.rowoff;
@@ -1144,19 +6019,17 @@ void editor_draw_rows(struct abuf *ab) {
 
                 int padding = (E.screen_cols - welcome_len) / 2;
                 if (padding) {
-                    abuf_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) {
-                    abuf_append(ab, " ", 1);
+                    frame_puts(f, y, 0, "~", 1, STYLE_DEFAULT);
                 }
-                abuf_append(ab, welcome, welcome_len);
+                frame_puts(f, y, padding, welcome, welcome_len,
+                           STYLE_DEFAULT);
             } else {
-                abuf_append(ab, "~", 1);
+                frame_puts(f, y, 0, "~", 1, STYLE_DEFAULT);
             }
         } else {
             // draw content read from file
-            int len = E.rows[file_row].rsize - E.coloff;
+            struct editor_row *row = editor_row_materialize(file_row, deadline);
+            int len = row->rsize - E.coloff;
             if (len < 0) {
                 len = 0;
             }
@@ -1164,142 +6037,112 @@ void editor_draw_rows(struct abuf *ab) {
                 len = E.screen_cols;  // truncate the line, only display until
                                       // edge of the screen
             }
-            char *c = &E.rows[file_row].render[E.coloff];
-            unsigned char *hl = &E.rows[file_row].hl[E.coloff];
-            int curr_color = -1;  // default text color
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    // if control character
-                    // translate into printable character (refer to ASCII table)
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abuf_append(ab, "\x1b[7m", 4);  // switch to inverted color
-                    abuf_append(ab, &sym, 1);
-                    // turn off inverted color
-                    // also turns off _ALL_ formatting
-                    abuf_append(ab, "\x1b[m", 3);
-
-                    if (curr_color != -1) {
-                        char buf[16];
-                        int c_len =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", curr_color);
-                        abuf_append(ab, buf, c_len);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (curr_color != -1) {
-                        // 39 is the default foreground color
-                        abuf_append(ab, "\x1b[39m", 5);
-                        curr_color = -1;
-                    }
-                    abuf_append(ab, &c[j], 1);
-                } else {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != curr_color) {
-                        curr_color = color;
-                        char buf[16];
-                        int clen =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abuf_append(ab, buf, clen);
-                    }
-                    abuf_append(ab, &c[j], 1);
+            unsigned char *hl = &editor_find_paint(row)[E.coloff];
+            char *chars = &f->chars[y * f->cols];
+            unsigned char *styles = &f->styles[y * f->cols];
+            memcpy(chars, &row->render[E.coloff], len);
+            // a run of one highlight class is a run of one style
+            for (int j = 0, run; j < len; j = run) {
+                for (run = j + 1; run < len && hl[run] == hl[j]; run++) {
+                }
+                memset(&styles[j], hl_style[hl[j]], run - j);
+            }
+            for (int j = 0; j < len; j++) {
+                unsigned char c = chars[j];
+                if (c < 0x20 || c == 0x7f) {
+                    // translate a control character into a printable one
+                    // (refer to ASCII table)
+                    chars[j] = (c <= 26) ? '@' + c : '?';
+                    styles[j] = STYLE_INVERSE;
+                } else if (c >= 0x80) {
+                    f->wide[y] = 1;
                 }
             }
-            // reset text color to default
-            abuf_append(ab, "\x1b[39m", 5);
         }
-        // erase current line, from the active cursor position to the end of
-        // line
-        abuf_append(ab, "\x1b[K", 3);
-        abuf_append(ab, "\r\n", 2);
     }
 }
 
-void editor_draw_status_bar(struct abuf *ab) {
-    abuf_append(ab, "\x1b[7m", 4);  // switch to inverted colors
+void editor_draw_status_bar(struct frame *f) {
+    int y = E.screen_rows;
+    // inverted colors across the whole bar
+    for (int x = 0; x < E.screen_cols; x++) {
+        frame_puts(f, y, x, " ", 1, STYLE_INVERSE);
+    }
 
     char status[80];
     char rstatus[80];  // current line number
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                        E.filename ? E.filename : "[No Name]", E.num_rows,
                        E.dirty ? "(modified)" : "");
-    int rlen =
-        snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                 E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.num_rows);
+    int rlen = editor_save_status(rstatus, sizeof(rstatus));
+    rlen += editor_find_count_status(&rstatus[rlen], sizeof(rstatus) - rlen);
+    rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %d/%d",
+                     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                     E.num_rows);
     if (len > E.screen_cols) {
         len = E.screen_cols;
     }
-    abuf_append(ab, status, len);
-    while (len < E.screen_cols) {
-        if (E.screen_cols - len == rlen) {
-            // align to the right edge of the screen
-            abuf_append(ab, rstatus, rlen);
-            break;
-        } else {
-            abuf_append(ab, " ", 1);
-            len++;
-        }
+    frame_puts(f, y, 0, status, len, STYLE_INVERSE);
+    if (E.screen_cols - len >= rlen) {
+        // align to the right edge of the screen
+        frame_puts(f, y, E.screen_cols - rlen, rstatus, rlen, STYLE_INVERSE);
     }
-    abuf_append(ab, "\x1b[m", 3);  // switch back to normal formatting
-    abuf_append(ab, "\r\n", 2);    // message & timestamp
 }
 
-void editor_draw_message_bar(struct abuf *ab) {
-    abuf_append(ab, "\x1b[K", 3);
+void editor_draw_message_bar(struct frame *f) {
     int msg_len = strlen(E.status_msg);
     if (msg_len > E.screen_cols) {
         msg_len = E.screen_cols;
     }
-    if (msg_len && time(NULL) - E.status_msg_time < 5) {
+    if (msg_len && time(NULL) - E.status_msg_time < KILO_MESSAGE_SECONDS) {
         // only if the msg is less than 5 seconds old
-        abuf_append(ab, E.status_msg, msg_len);
+        frame_puts(f, E.screen_rows + 1, 0, E.status_msg, msg_len,
+                   STYLE_DEFAULT);
     }
 }
 
-void editor_refresh_screen() {
+/**
+ * Draw the screen and append what it takes to show it to `ab`
+ */
+void editor_render(struct abuf *ab) {
     editor_scroll();
 
-    struct abuf ab = ABUF_INIT;
-    // write an escape sequence to the terminal, which _always_ starts with:
-    // `\x1b` - the first byte, the escape character
-    // and followed by `[`
-    // sequence: `Esc [ P(arameter)s J`
-
-    // hide the cursor
-    // https://vt100.net/docs/vt510-rm/DECTCEM.html
-    abuf_append(&ab, "\x1b[?25l", 6);
-
-    // erase all screen
-    // instead, we clear line by line as we redraw them
-    // abuf_append(&ab, "\x1b[2J", 4);
-
-    // Reposition the cursor to top left
-    // `ESC [ Pn ; Pn H`
-    // default: `Esc [ 1;1 H`
-    abuf_append(&ab, "\x1b[H", 3);
-
-    // draw ~ on the first column of all rows
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+    if (E.frame.rows != E.screen_rows + 2 || E.frame.cols != E.screen_cols) {
+        frame_resize(&E.frame, E.screen_rows + 2, E.screen_cols);
+    }
+    frame_clear(&E.frame);
+    editor_draw_rows(&E.frame);
+    editor_draw_status_bar(&E.frame);
+    editor_draw_message_bar(&E.frame);
 
-    // move cursor to the positions stored
-    char buf[32];
-    // +1 to E.cx and E.cy to convert from 0-indexed values to
-    // the 1-indexed values used by terminal
     // notice the vertical `E.cy` - cy is no longer cursor position on screen
     // now cy is cursor position within the file
     // we need to re-position cursor on screen
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1);
-    abuf_append(&ab, buf, strlen(buf));  // notice the `strlen`
-
-    // show the cursor
-    // https://vt100.net/docs/vt510-rm/DECTCEM.html
-    abuf_append(&ab, "\x1b[?25h", 6);
-
-    if (write(STDOUT_FILENO, ab.buffer, ab.len) == -1) die("write");
+    editor_frame_flush(ab, E.cy - E.rowoff, E.rx - E.coloff);
+}
 
-    abuf_free(&ab);
+void editor_refresh_screen() {
+    // keys still to be handled would make this frame stale at once: draw one
+    // frame for the lot after the last of them
+    if (editor_input_pending()) {
+        return;
+    }
+    // kept from one refresh to the next, so it only grows for the first few
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
+    editor_render(&ab);
+    if (ab.len == 0) {
+        return;
+    }
+    // between the begin and end of a synchronized update the terminal keeps
+    // showing the old frame, so it never shows half of the new one
+    struct iovec iov[] = {{"\x1b[?2026h", 8},
+                          {ab.buffer, ab.len},
+                          {"\x1b[?2026l", 8}};
+    int sync = E.sync_output;
+    if (write_all(STDOUT_FILENO, &iov[!sync], sync ? 3 : 1) == -1) {
+        die("write");
+    }
 }
 
 void editor_set_status_message(const char *fmt, ...) {
@@ -1311,6 +6154,297 @@ void editor_set_status_message(const char *fmt, ...) {
     E.status_msg_time = time(NULL);
 }
 
+/*** benchmarks ***/
+
+/**
+ * `kilo --bench <file>`: time the hot paths over a real file and print the
+ * throughput, without touching the terminal
+ */
+int editor_bench(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        perror(filename);
+        return 1;
+    }
+    size_t len = st.st_size;
+    char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+    printf("%s: %zu bytes\n", filename, len);
+
+    struct {
+        const char *name;
+        scan_newlines_fn fn;
+    } scanners[] = {
+        {"scalar", scan_newlines_scalar},
+#ifdef KILO_X86
+        {"sse2", scan_newlines_sse2},
+        {"avx2", scan_newlines_avx2},
+#endif
+    };
+    const char *best;
+    scan_newlines_best(&best);
+    for (unsigned int j = 0; j < sizeof(scanners) / sizeof(scanners[0]); j++) {
+#ifdef KILO_X86
+        if (!strcmp(scanners[j].name, "avx2") &&
+            !__builtin_cpu_supports("avx2")) {
+            continue;
+        }
+#endif
+        struct line_index idx = {0};
+        int runs = 5;
+        uint64_t fastest = UINT64_MAX;
+        while (runs--) {
+            uint64_t start = now_ns();
+            line_index_scan_with(&idx, buf, len, scanners[j].fn);
+            uint64_t elapsed = now_ns() - start;
+            if (elapsed < fastest) fastest = elapsed;
+        }
+        printf("newline scan %-6s%s %8.2f GB/s  %zu lines\n",
+               scanners[j].name, strcmp(scanners[j].name, best) ? " " : "*",
+               (double)len / fastest, idx.count);
+        line_index_free(&idx);
+    }
+
+    // search every line for a query that is in none of them
+    struct {
+        const char *name;
+        search_fn fn;
+    } searches[] = {
+        {"scalar", search_scalar},
+#ifdef KILO_X86
+        {"sse2", search_sse2},
+        {"avx2", search_avx2},
+#endif
+    };
+    search_best(&best);
+    struct line_index lines = {0};
+    line_index_scan(&lines, buf, len);
+    for (int ignore_case = 0; ignore_case <= 1; ignore_case++) {
+        struct search_needle needle;
+        search_needle_init(&needle, "kilo_NO_such_Text", ignore_case);
+        for (unsigned int j = 0; j < sizeof(searches) / sizeof(searches[0]);
+             j++) {
+#ifdef KILO_X86
+            if (!strcmp(searches[j].name, "avx2") &&
+                !__builtin_cpu_supports("avx2")) {
+                continue;
+            }
+#endif
+            int runs = 5;
+            uint64_t fastest = UINT64_MAX;
+            while (runs--) {
+                uint64_t start = now_ns();
+                for (size_t i = 0; i < lines.count; i++) {
+                    int line_len = line_index_line_len(&lines, buf, len, i);
+                    if (line_len >= needle.len) {
+                        searches[j].fn(&buf[lines.starts[i]], line_len,
+                                       &needle);
+                    }
+                }
+                uint64_t elapsed = now_ns() - start;
+                if (elapsed < fastest) fastest = elapsed;
+            }
+            printf("search %-6s%s %-6s %8.2f GB/s\n", searches[j].name,
+                   strcmp(searches[j].name, best) ? " " : "*",
+                   ignore_case ? "icase" : "", (double)len / fastest);
+        }
+        search_needle_free(&needle);
+    }
+
+    // regular expressions: with a literal prefix to skip ahead to, without
+    // one, and one a backtracking engine could take exponential time on
+    char *patterns[] = {"kilo_NO_such_\\w+", "[k]ilo_NO_such_\\w+",
+                        "(\\w|\\w\\w)*=$"};
+    for (unsigned int p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        struct search_needle needle;
+        const char *error;
+        search_needle_init_regex(&needle, patterns[p], 0, &error);
+        int runs = 3, found = 0;
+        uint64_t fastest = UINT64_MAX;
+        while (runs--) {
+            uint64_t start = now_ns();
+            found = 0;
+            for (size_t i = 0; i < lines.count; i++) {
+                found += search_any(&buf[lines.starts[i]],
+                                    line_index_line_len(&lines, buf, len, i),
+                                    &needle);
+            }
+            uint64_t elapsed = now_ns() - start;
+            if (elapsed < fastest) fastest = elapsed;
+        }
+        printf("regex %-22s %8.2f GB/s  %d lines\n", patterns[p],
+               (double)len / fastest, found);
+        search_needle_free(&needle);
+    }
+
+    // the trigram index: its cost, and what it saves a search
+    uint64_t start = now_ns();
+    struct trigram_index *index = trigram_index_new();
+    for (size_t i = 0; i < lines.count; i++) {
+        trigram_index_add(index, i, &buf[lines.starts[i]],
+                          line_index_line_len(&lines, buf, len, i));
+    }
+    size_t index_bytes = trigram_index_bytes(index);
+    printf("trigram index  %8.2f ms  %.1f MB (%.2fx the file)\n",
+           (now_ns() - start) / 1e6, index_bytes / 1048576.0,
+           (double)index_bytes / len);
+    // a query that matches nothing, and one from the middle of the file
+    char rare[9] = "";
+    size_t mid = lines.count / 2;
+    int mid_len = line_index_line_len(&lines, buf, len, mid);
+    if (mid_len >= 8) {
+        memcpy(rare, &buf[lines.starts[mid] + mid_len / 2 - 4], 8);
+    }
+    char *queries[] = {"kilo_NO_such_Text", rare};
+    for (int q = 0; q < 2 && queries[q][0]; q++) {
+        for (int indexed = 0; indexed <= 1; indexed++) {
+            struct search_needle needle;
+            search_needle_init(&needle, queries[q], 0);
+            uint32_t limit = lines.count;
+            uint64_t *groups = NULL;
+            start = now_ns();
+            if (indexed) {
+                groups = calloc(index_groups_words(limit), sizeof(uint64_t));
+                trigram_index_query(index, &needle, groups);
+            }
+            int found = 0;
+            for (size_t i = 0; i < lines.count; i++) {
+                found += index_candidate(groups, limit, i) &&
+                         search_first(&buf[lines.starts[i]],
+                                      line_index_line_len(&lines, buf, len, i),
+                                      &needle) != -1;
+            }
+            printf("find %-7s %8.2f ms  %d lines match \"%s\"\n",
+                   indexed ? "indexed" : "scan", (now_ns() - start) / 1e6,
+                   found, queries[q]);
+            free(groups);
+            search_needle_free(&needle);
+        }
+    }
+    trigram_index_free(index);
+    line_index_free(&lines);
+
+    uint64_t load_start = now_ns();
+    editor_load_syntaxes();
+    printf("syntax files   %8.2f ms  %d loaded\n",
+           (now_ns() - load_start) / 1e6,
+           syntax_db_len);
+    for (int j = 0; j < syntax_db_len + (int)HLDB_ENTRIES; j++) {
+        struct editor_syntax *s =
+            j < syntax_db_len ? &syntax_db[j] : &HLDB[j - syntax_db_len];
+        if (s->lexer == NULL) {
+            s->lexer = lexer_compile(s);
+        }
+        printf("lexer %-8s %8.2f ms  %d states x %d classes\n", s->filetype,
+               s->lexer->compile_ns / 1e6, s->lexer->n_states,
+               s->lexer->n_classes);
+    }
+
+    // highlight the file line by line with the lexer its name selects
+    E.filename = filename;
+    editor_select_syntax_highlight();
+    if (E.syntax) {
+        struct line_index idx = {0};
+        line_index_scan(&idx, buf, len);
+        unsigned char *hl = malloc(len);
+        int runs = 5;
+        uint64_t fastest = UINT64_MAX;
+        while (runs--) {
+            uint64_t start = now_ns();
+            int in_comment = 0;
+            for (size_t i = 0; i < idx.count; i++) {
+                size_t at = idx.starts[i];
+                int line_len = line_index_line_len(&idx, buf, len, i);
+                in_comment = lexer_run(E.syntax->lexer, &buf[at], line_len,
+                                       &hl[at], in_comment);
+            }
+            uint64_t elapsed = now_ns() - start;
+            if (elapsed < fastest) fastest = elapsed;
+        }
+        printf("highlight %-6s %8.2f GB/s\n", E.syntax->filetype,
+               (double)len / fastest);
+        free(hl);
+
+        // comment states of every row, as resolved when the file is opened
+        row_tree_init(&E.rows);
+        editor_load_mapped_rows(buf, len, &idx);
+        line_index_free(&idx);
+        editor_invalidate_syntax();
+        uint64_t start = now_ns();
+        editor_hl_resolve(E.num_rows - 1, 0);
+        printf("comment states     %8.2f ms  serial\n",
+               (now_ns() - start) / 1e6);
+        for (int n = 1;; n *= 2) {
+            if (n > worker_pool_size()) n = worker_pool_size();
+            editor_invalidate_syntax();
+            start = now_ns();
+            editor_hl_resolve_parallel(n);
+            printf("comment states     %8.2f ms  %d threads\n",
+                   (now_ns() - start) / 1e6, n);
+            if (n == worker_pool_size()) break;
+        }
+    }
+
+    // bytes a refresh writes: a whole screen, then after typing a character,
+    // scrolling down a line and moving down a page
+    if (E.num_rows == 0) {
+        struct line_index idx = {0};
+        line_index_scan(&idx, buf, len);
+        row_tree_init(&E.rows);
+        editor_load_mapped_rows(buf, len, &idx);
+        line_index_free(&idx);
+    }
+    E.screen_rows = 48;
+    E.screen_cols = 160;
+    E.cy = E.num_rows / 2;
+    char *steps[] = {"full", "type", "line", "page"};
+    for (int step = 0; step < 4; step++) {
+        if (step == 1) {
+            editor_insert_char('x');
+        } else if (step == 2) {
+            E.cy = E.rowoff + E.screen_rows;
+        } else if (step == 3) {
+            E.cy += E.screen_rows - 1;
+        }
+        struct abuf ab = ABUF_INIT;
+        uint64_t start = now_ns();
+        editor_render(&ab);
+        printf("refresh %-6s %8.2f ms  %d bytes\n", steps[step],
+               (now_ns() - start) / 1e6, ab.len);
+        abuf_free(&ab);
+    }
+
+    // saving the whole file, to a copy next to it
+    size_t copy_size = strlen(filename) + 16;
+    char *copy = malloc(copy_size);
+    snprintf(copy, copy_size, "%s.kilo-bench", filename);
+    struct snapshot *snap = editor_snapshot_take();
+    long long written = 0;
+    start = now_ns();
+    if (snapshot_save(snap, copy, new_file_mode(), &written) == 0) {
+        uint64_t elapsed = now_ns() - start;
+        printf("save               %8.2f ms  %.0f MB/s\n", elapsed / 1e6,
+               written / 1048576.0 / (elapsed / 1e9));
+        unlink(copy);
+    } else {
+        perror(copy);
+    }
+    editor_snapshot_release(snap);
+    free(copy);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak RSS           %8ld MB\n", usage.ru_maxrss / 1024);
+
+    munmap(buf, len);
+    return 0;
+}
+
 /*** init ***/
 
 /**
@@ -1323,13 +6457,18 @@ void init_editor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.num_rows = 0;
-    E.rows = NULL;
+    E.hl_horizon = 0;
+    row_tree_init(&E.rows);
     E.dirty = 0;
     E.filename = NULL;
     E.status_msg[0] = '\0';
     E.status_msg_time = 0;
     E.syntax = NULL;
+    E.find_ignore_case = 0;
+    E.map = NULL;
+    E.map_len = 0;
 
+    E.sync_output = get_sync_output_support();
     if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) {
         die("get_window_size");
     }
@@ -1339,14 +6478,25 @@ void init_editor() {
 }
 
 int main(int argc, char *argv[]) {
+    sgr_table_init();
+    if (argc >= 3 && !strcmp(argv[1], "--bench")) {
+        return editor_bench(argv[2]);
+    }
+
+    event_loop_init();
     enable_raw_mode();
     init_editor();
+    editor_load_syntaxes();
     if (argc >= 2) {
         editor_open(argv[1]);
     }
 
-    editor_set_status_message(
-        "HELP: Ctrl-F = find | Ctrl-S = save | Ctrl-Q = quit");
+    if (E.status_msg[0] == '\0') {
+        // unless loading syntax files had something to say
+        editor_set_status_message(
+            "HELP: Ctrl-F = find | Ctrl-R = replace | Ctrl-S = save | "
+            "Ctrl-Q = quit");
+    }
 
     // read 1 byte from stdin into c until no more bytes to read
     // read() returns number of bytes read; returns 0 if reached EOF